@@ -29,6 +29,8 @@
 #if KEYPAD_ENABLE
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <math.h>
 
@@ -41,6 +43,10 @@
 #include "../grbl/protocol.h"
 #include "../grbl/nvs_buffer.h"
 #include "../grbl/state_machine.h"
+#include "../grbl/planner.h"
+#if KEYPAD_MACRO_FILES
+#include "../grbl/vfs.h"
+#endif
 #else
 #include "i2c.h"
 #include "grbl/report.h"
@@ -50,40 +56,314 @@
 #include "grbl/state_machine.h"
 #include "grbl/machine_limits.h"
 #include "grbl/motion_control.h"
+#include "grbl/planner.h"
+#if KEYPAD_MACRO_FILES
+#include "grbl/vfs.h"
+#endif
 #endif
 
+// Exchanges a value shared between the protocol loop and the interrupt handlers, returns the previous value.
+// hal.set_value_atomic() only guards against interrupts on the calling core, with the I/O task enabled
+// the I2C interrupt handlers may run on the other core.
+#define shared_xchg(ptr, value) __atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST)
+
 typedef struct {
     char buf[KEYBUF_SIZE];
     volatile uint_fast8_t head;
     volatile uint_fast8_t tail;
 } keybuffer_t;
 
-static char buf[(STRLEN_COORDVALUE + 1) * N_AXIS];
+typedef struct {
+    volatile uint_fast8_t rx_count; // number of bitmap bytes still to be received
+    uint32_t rx_bits;               // bitmap being received
+    uint32_t rx_time;               // tick when the last bitmap byte was received
+    volatile bool strobe;           // last keycode read was part of a bitmap, its strobe release does not stop jogging
+    volatile uint32_t bits;         // last complete bitmap
+    uint_fast16_t gen;              // release generation when the bitmap was received
+    uint32_t active;                // bitmap of the jog in progress
+#if KEYPAD_IO_TASK
+    volatile uint_fast16_t changed; // new bitmap to be processed by the protocol loop
+#endif
+} jog_vector_t;
+
+// Jog lifecycle, transitions are made with shared_xchg() as the state
+// is shared between the foreground process and the keypad interrupt handlers.
+// A jog is only Active once the core has reported STATE_JOG for it, see onStateChanged().
+typedef enum {
+    JogState_Idle = 0,
+    JogState_Requested,     // Foreground process is handing the jog command to the core.
+    JogState_Pending,       // Jog command handed to the core, waiting for it to enter STATE_JOG.
+    JogState_Active,        // Jog running, a release will cancel it.
+    JogState_Cancelling     // Key released, jog cancel sent or to be sent when the jog starts.
+} jog_state_t;
+
+#define JOG_LINE_SIZE (16 + N_AXIS * 12)
+
+// Jog command waiting to be handed to the core by jog_dispatch().
+// The distance is clipped to the soft limits and put into the command when it is handed over.
+typedef struct {
+    char line[JOG_LINE_SIZE];   // command with ? in place of the distance, empty if none
+    uint32_t bits;              // JOG_VECTOR style direction bitmap
+    float distance;             // unclipped distance
+    uint_fast8_t decimals;      // decimals of the distance
+    uint_fast16_t gen;          // release generation when the command was built
+    bool awaiting;              // command handed to the core, STATE_JOG not yet reported
+    uint32_t submitted;         // tick when the command was handed to the core
+} jog_pending_t;
+
+typedef struct {
+    volatile char keycode;  // keycode to repeat, 0 if none, cleared by the interrupt handlers
+    uint_fast16_t gen;      // release generation when the key was pressed
+    uint32_t next;          // tick when next repeat is due
+    uint32_t interval;      // current repeat interval
+} keyrepeat_t;
+
 
 static on_state_change_ptr on_state_change;
 //static on_execute_realtime_ptr on_execute_realtime; // For real time loop insertion
 
 #define SEND_STATUS_DELAY 300
 #define SEND_STATUS_JOG_DELAY 100
+#define REPEAT_RETRY_DELAY 10
+#define JOG_START_TIMEOUT 500 // ms to wait for STATE_JOG before a jog command is considered rejected
+#define MESSAGE_RETRY_DELAY 10
+#define SPINDLE_RETRY_DELAY 10
+#define KEEPALIVE_RETRY_DELAY 10
+#define STROBE_READ_TIMEOUT 20      // Max. time a keepalive read is held back for an outstanding strobe keycode read.
+#define OVERRIDE_COARSE_STEP 10 // percent, same as the core coarse override increment
+
+// Periodic tasks, run in this order when due at the same time. Tasks from Task_Keepalive on
+// only perform pendant I/O and run from keypad_io_task() when the I/O task is enabled.
+typedef enum {
+    Task_Repeat = 0,
+    Task_JogVector,
+    Task_Link,
+    Task_Spindle,
+    Task_Status,
+    Task_StatusBuild,
+    Task_Keepalive,
+    Task_Message,
+    Task_N
+} keypad_task_id_t;
+
+#if KEYPAD_IO_TASK
+#define TASK_CONTEXT(id) ((id) >= Task_Keepalive) // 1 for tasks run by the I/O task
+#else
+#define TASK_CONTEXT(id) 0
+#endif
+
+typedef void (*keypad_task_ptr)(uint32_t ms);
+
+typedef struct {
+    bool active;
+    uint32_t deadline;
+} keypad_task_t;
+
+static keypad_task_t tasks[Task_N] = {0};
+static uint32_t next_deadline[2];   // per context, see TASK_CONTEXT()
+#if KEYPAD_IO_TASK
+static volatile uint_fast16_t task_requests[Task_N] = {0}; // Tasks to run as soon as possible, set from the other context.
+#endif
 
 static bool is_executing = false;
 static char *command;
 static nvs_address_t keypad_nvs_address;
 static nvs_address_t macro_nvs_address;
-static macro_settings_t macro_plugin_settings;
-static stream_read_ptr stream_read;
+
+// Source of a line read by the parser through the input multiplexer.
+typedef enum {
+    MuxLine_None = 0,
+    MuxLine_Host,
+    MuxLine_Macro
+} mux_line_t;
+
+// Input multiplexer, injects macro blocks into the parser between lines of the host stream.
+typedef struct {
+    bool attached;
+    bool macro_end;                     // All of the macro has been read.
+    bool macro_next;                    // Macro gets the next line when both have data.
+    mux_line_t reading;                 // Source of the line being read.
+    mux_line_t executing;               // Source of the last complete line, its status is reported next.
+    stream_read_ptr stream_read;        // Host stream read function.
+    status_message_ptr status_message;  // Status message handler to restore.
+} stream_mux_t;
+
+static stream_mux_t mux = {0};
 static driver_reset_ptr driver_reset;
 
 static int16_t get_macro_char (void);
+static void keypad_report_message (const char *msg, message_type_t type);
+static void send_status_info (void);
+#if KEYPAD_PERF && KEYPAD_ENABLE == 1
+ISR_CODE static void ISR_FUNC(i2c_enqueue_keycode)(char c);
+#endif
+
+typedef enum {
+    MacroSource_String = 0,
+    MacroSource_NVS,
+    MacroSource_File
+} macro_source_t;
+
+// Read-ahead window for a macro streamed from NVS or a file,
+// macros are not kept in RAM.
+typedef struct {
+    macro_source_t source;
+    nvs_address_t address;  // next NVS address to read from
+    size_t remaining;       // bytes left to read from NVS
+#if KEYPAD_MACRO_FILES
+    vfs_file_t *file;
+#endif
+    size_t len;
+    size_t pos;
+    char buf[KEYPAD_MACRO_WINDOW];
+} macro_stream_t;
+
+static macro_stream_t macro_stream = {0};
+static macro_setting_t macro_edit;          // Scratch for settings access and file paths.
+
+// NVS address of a macro slot, the slots are stored in a single checksummed macro_settings_t block.
+#define MACRO_NVS_ADDRESS(idx) (macro_nvs_address + offsetof(macro_settings_t, macro) + (idx) * sizeof(macro_setting_t))
+static macro_settings_t *macro_block = NULL;   // Block with pending edits, allocated by macro_set() and released on save.
+
+#if KEYPAD_MACRO_FILES
+#define MACRO_FILE_DESCR " Or @ followed by the path of a file on the local filesystem to stream the macro from."
+#else
+#define MACRO_FILE_DESCR ""
+#endif
+
+typedef struct {
+    uint32_t timestamp;
+    sys_state_t state;
+    uint8_t mode;
+    bool disconnected;
+    uint8_t alarm;
+    uint8_t home_state;
+    uint8_t feed_override;
+    uint8_t spindle_override;
+    uint8_t spindle_stop;
+    int spindle_rpm;
+    float feed_rate;
+    coolant_state_t coolant_state;
+    uint8_t jog_mode;
+    float jog_stepsize;
+    coord_system_id_t current_wcs;
+    float position[N_AXIS];
+    float velocity[N_AXIS];
+} status_snapshot_t;
 
 static Machine_status_packet status_packet;
 
-static uint8_t *status_ptr = (uint8_t*) &status_packet;
-static bool jogging = false, keyreleased = true;
+// Status frame assembly stages, run in this order.
+typedef enum {
+    StatusStage_Idle = 0,
+    StatusStage_Motion,
+    StatusStage_Position,
+    StatusStage_Machine,
+    StatusStage_Spindle,
+    StatusStage_Send
+} status_stage_t;
+
+typedef struct {
+    status_stage_t stage;           // next stage to run
+    bool pending;                   // frame requested while one was being assembled
+    uint32_t last_ms;               // tick when the last frame was sent
+    uint32_t cost[StatusStage_Send + 1]; // worst case stage run time in us
+    uint32_t measured;              // bitmap of stages with a known cost
+    int32_t steps[N_AXIS];          // step position sampled with the motion state
+    status_snapshot_t snap;         // frame being assembled
+} status_build_t;
+
+static status_build_t status_build = {0};
+
+// Actual spindle RPM sampled by keypad_spindle_task() while the spindle is on.
+typedef struct {
+    uint32_t timestamp;     // tick when sampled
+    int rpm;
+} spindle_cache_t;
+
+static spindle_cache_t spindle_cache = {0};
+
+typedef struct {
+    message_type_t type;
+    char text[KEYPAD_MSG_LENGTH + 1];
+} keypad_msg_t;
+
+// Messages to the pendant, sent a page at a time.
+typedef struct {
+    volatile uint_fast8_t head;
+    volatile uint_fast8_t tail;
+    uint8_t id;         // sequence number of the message being sent
+    uint8_t page;       // next page of the message being sent
+    keypad_msg_t msg[KEYPAD_MSG_QUEUE];
+} msgqueue_t;
+
+static msgqueue_t msgqueue = {0};
+static Machine_message_packet message_packet;
+static on_gcode_message_ptr on_gcode_message;
+static on_report_handlers_init_ptr on_report_handlers_init;
+static status_message_ptr status_message;
+static feedback_message_ptr feedback_message;
+
+#if KEYPAD_IO_TASK
+
+// Homing requests from the I2C interrupt handlers, that run on the I/O core, to the protocol loop.
+// Single producer (I2C interrupt handlers, not nested), single consumer (protocol loop) queue.
+typedef struct {
+    volatile uint_fast8_t head;
+    volatile uint_fast8_t tail;
+    char cmd[KEYPAD_ACTION_QUEUE];
+} actionq_t;
+
+static actionq_t actionq = {0};
+
+// Status snapshots from the protocol loop to the I/O task.
+// Single producer (protocol loop), single consumer (I/O task) queue.
+typedef struct {
+    volatile uint_fast8_t head;
+    volatile uint_fast8_t tail;
+    status_snapshot_t snap[KEYPAD_SNAPSHOT_QUEUE];
+} snapq_t;
+
+static snapq_t snapq = {0};
+
+#endif
+
+// Pendant heartbeat, keycodes and keepalive read replies count as responses.
+typedef struct {
+    volatile bool disconnected;
+    volatile uint32_t last_rx;  // tick of the last keycode or keepalive reply received
+    volatile bool strobe_read;  // keycode read started by the strobe interrupt is outstanding
+#if KEYPAD_IO_TASK
+    volatile bool strobe_request; // keycode read to be started by keypad_io_task()
+#endif
+    volatile uint32_t strobe_time; // tick when the strobe keycode read was started
+    uint32_t jog_start;         // tick when the last jog was submitted
+    volatile bool resend;       // pendant requested the last status frame again
+    bool retry;                 // last status frame transaction failed, retry on the next pass
+    uint8_t sequence;           // sequence number of the last status frame, wraps
+    bool frame_valid;           // a status frame has been built and can be sent again
+    uint32_t sent;              // status frame transactions
+    uint32_t failed;            // failed status frame transactions
+    uint32_t retried;           // status frames sent again after a failure or a NAK
+    volatile uint32_t nak;      // resend requests received
+} pendant_link_t;
+
+static pendant_link_t pendant_link = {0};
+static volatile bool keyreleased = true;    // Set by the interrupt handlers on key release, cleared on key down.
+static volatile uint_fast16_t jog_state = JogState_Idle;
+static volatile uint_fast16_t jog_release_gen = 0; // Incremented on every key release.
+static jog_pending_t jog_pending = {0};
 static jogmode_t jogMode = JogMode_Fast;
 static jogmodify_t jogModify = JogModify_1;
+static const float jog_modify_factor[] = {
+    [JogModify_1] = 1.0f,
+    [JogModify_01] = 0.1f,
+    [JogModify_001] = 0.01f
+};
 static jog_settings_t jog;
 static keybuffer_t keybuf = {0};
+static keyrepeat_t keyrepeat = {0};
+static jog_vector_t jog_vector = {0};
 static on_report_options_ptr on_report_options;
 static on_execute_realtime_ptr on_execute_realtime, on_execute_delay;
 static on_jogmode_changed_ptr on_jogmode_changed;
@@ -92,6 +372,86 @@ static on_jogmodify_changed_ptr on_jogmodify_changed;
 static on_spindle_select_ptr on_spindle_select;
 spindle_ptrs_t *current_spindle = NULL;
 
+#if KEYPAD_PERF
+
+typedef enum {
+    Perf_StatusSend = 0,
+    Perf_KeypressJog,
+    Perf_KeypressOverride,
+    Perf_KeypressOther,
+    Perf_KeypadEnqueue,
+    Perf_I2CEnqueue,
+    Perf_StatusAssemble,
+    Perf_JogString,
+    Perf_MacroChar,
+    Perf_KeypadEnqueueBatch,
+    Perf_I2CEnqueueBatch,
+    Perf_Keypress_0 // first of the per jog keycode benchmarks
+} perf_id_t;
+
+// Timestamps are CPU cycles where the core has a DWT cycle counter (Cortex-M3/M4/M7),
+// microseconds otherwise. Per call timings of sub microsecond paths are only meaningful
+// with the cycle counter, the batched benchmarks in perf_run() do not depend on it.
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+#define PERF_CYCLES 1
+#define PERF_DEMCR      (*(volatile uint32_t *)0xE000EDFC)
+#define PERF_DWT_CTRL   (*(volatile uint32_t *)0xE0001000)
+#define PERF_DWT_CYCCNT (*(volatile uint32_t *)0xE0001004)
+#else
+#define PERF_CYCLES 0
+#endif
+
+typedef struct {
+    uint32_t calls;
+    uint64_t total;
+    uint32_t max;
+} perf_counter_t;
+
+// Counters for the code paths that are timed during normal operation.
+static perf_counter_t perf_counters[Perf_StatusAssemble] = {0};
+static volatile bool perf_batch = false;
+
+static void perf_init (void)
+{
+#if PERF_CYCLES
+    PERF_DEMCR |= (1UL << 24);  // TRCENA
+    PERF_DWT_CYCCNT = 0;
+    PERF_DWT_CTRL |= 1UL;       // CYCCNTENA
+#endif
+}
+
+static inline uint32_t perf_now (void)
+{
+#if PERF_CYCLES
+    return PERF_DWT_CYCCNT;
+#else
+    return hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks() * 1000UL;
+#endif
+}
+
+static void perf_count (perf_id_t id, uint32_t t0)
+{
+    uint32_t t = perf_now() - t0;
+
+    if(perf_batch) // Do not count calls made by the batched benchmarks.
+        return;
+
+    perf_counters[id].calls++;
+    perf_counters[id].total += t;
+    if(t > perf_counters[id].max)
+        perf_counters[id].max = t;
+}
+
+#define PERF_BEGIN() uint32_t perf_t0 = perf_now()
+#define PERF_END(id) perf_count(id, perf_t0)
+
+#else
+
+#define PERF_BEGIN()
+#define PERF_END(id)
+
+#endif
+
 
 keypad_t keypad = {0};
 
@@ -115,28 +475,31 @@ static const setting_descr_t keypad_settings_descr[] = {
 };
 #endif
 
+static status_code_t macro_set (setting_id_t id, char *value);
+static char *macro_get (setting_id_t id);
+
 static const setting_detail_t macro_settings[] = {
-    { Setting_UserDefined_0, Group_Jogging, "Macro 1 UP", NULL, Format_String, "x(127)", "0", "127", Setting_NonCore, &macro_plugin_settings.macro[0].data, NULL, NULL },
-    { Setting_UserDefined_1, Group_Jogging, "Macro 2 RIGHT", NULL, Format_String, "x(127)", "0", "127", Setting_NonCore, &macro_plugin_settings.macro[1].data, NULL, NULL },
-    { Setting_UserDefined_2, Group_Jogging, "Macro 3 DOWN", NULL, Format_String, "x(127)", "0", "127", Setting_NonCore, &macro_plugin_settings.macro[2].data, NULL, NULL },
-    { Setting_UserDefined_3, Group_Jogging, "Macro 4 LEFT", NULL, Format_String, "x(127)", "0", "127", Setting_NonCore, &macro_plugin_settings.macro[3].data, NULL, NULL },
-    { Setting_UserDefined_4, Group_Jogging, "Macro 5 SPINDLE", NULL, Format_String, "x(127)", "0", "127", Setting_NonCore, &macro_plugin_settings.macro[4].data, NULL, NULL },
+    { Setting_UserDefined_0, Group_Jogging, "Macro 1 UP", NULL, Format_String, "x(127)", "0", "127", Setting_NonCoreFn, macro_set, macro_get, NULL },
+    { Setting_UserDefined_1, Group_Jogging, "Macro 2 RIGHT", NULL, Format_String, "x(127)", "0", "127", Setting_NonCoreFn, macro_set, macro_get, NULL },
+    { Setting_UserDefined_2, Group_Jogging, "Macro 3 DOWN", NULL, Format_String, "x(127)", "0", "127", Setting_NonCoreFn, macro_set, macro_get, NULL },
+    { Setting_UserDefined_3, Group_Jogging, "Macro 4 LEFT", NULL, Format_String, "x(127)", "0", "127", Setting_NonCoreFn, macro_set, macro_get, NULL },
+    { Setting_UserDefined_4, Group_Jogging, "Macro 5 SPINDLE", NULL, Format_String, "x(127)", "0", "127", Setting_NonCoreFn, macro_set, macro_get, NULL },
 #if N_MACROS > 5
-    { Setting_UserDefined_5, Group_Jogging, "Macro 6 RAISE", NULL, Format_String, "x(127)", "0", "127", Setting_NonCore, &macro_plugin_settings.macro[5].data, NULL, NULL },
-    { Setting_UserDefined_6, Group_Jogging, "Macro 7 LOWER", NULL, Format_String, "x(127)", "0", "127", Setting_NonCore, &macro_plugin_settings.macro[6].data, NULL, NULL },
+    { Setting_UserDefined_5, Group_Jogging, "Macro 6 RAISE", NULL, Format_String, "x(127)", "0", "127", Setting_NonCoreFn, macro_set, macro_get, NULL },
+    { Setting_UserDefined_6, Group_Jogging, "Macro 7 LOWER", NULL, Format_String, "x(127)", "0", "127", Setting_NonCoreFn, macro_set, macro_get, NULL },
 #endif
 };
 
 #ifndef NO_SETTINGS_DESCRIPTIONS
 static const setting_descr_t macro_settings_descr[] = {
-    { Setting_UserDefined_0, "Macro content for macro 1, separate blocks (lines) with the vertical bar character |." },
-    { Setting_UserDefined_1, "Macro content for macro 2, separate blocks (lines) with the vertical bar character |." },
-    { Setting_UserDefined_2, "Macro content for macro 3, separate blocks (lines) with the vertical bar character |." },
-    { Setting_UserDefined_3, "Macro content for macro 4, separate blocks (lines) with the vertical bar character |." },
-    { Setting_UserDefined_4, "Macro content for macro 5, separate blocks (lines) with the vertical bar character |." },
+    { Setting_UserDefined_0, "Macro content for macro 1, separate blocks (lines) with the vertical bar character |." MACRO_FILE_DESCR },
+    { Setting_UserDefined_1, "Macro content for macro 2, separate blocks (lines) with the vertical bar character |." MACRO_FILE_DESCR },
+    { Setting_UserDefined_2, "Macro content for macro 3, separate blocks (lines) with the vertical bar character |." MACRO_FILE_DESCR },
+    { Setting_UserDefined_3, "Macro content for macro 4, separate blocks (lines) with the vertical bar character |." MACRO_FILE_DESCR },
+    { Setting_UserDefined_4, "Macro content for macro 5, separate blocks (lines) with the vertical bar character |." MACRO_FILE_DESCR },
 #if N_MACROS > 5
-    { Setting_UserDefined_5, "Macro content for macro 6, separate blocks (lines) with the vertical bar character |." },
-    { Setting_UserDefined_6, "Macro content for macro 7, separate blocks (lines) with the vertical bar character |." },
+    { Setting_UserDefined_5, "Macro content for macro 6, separate blocks (lines) with the vertical bar character |." MACRO_FILE_DESCR },
+    { Setting_UserDefined_6, "Macro content for macro 7, separate blocks (lines) with the vertical bar character |." MACRO_FILE_DESCR },
 #endif    
 };
 #endif
@@ -144,15 +507,55 @@ static const setting_descr_t macro_settings_descr[] = {
 // Add info about our settings for $help and enumerations.
 // Potentially used by senders for settings UI.
 
+static status_code_t stream_mux_status (status_code_t status_code);
+static int16_t stream_mux_read (void);
+
+// Closes the macro source, the multiplexer stays attached until
+// the status of the last macro line has been reported.
+static void macro_close (void)
+{
+#if KEYPAD_MACRO_FILES
+    if(macro_stream.file) {
+        vfs_close(macro_stream.file);
+        macro_stream.file = NULL;
+    }
+#endif
+    macro_stream.source = MacroSource_String;
+    mux.macro_end = true;
+}
+
+static void stream_mux_attach (void)
+{
+    if(!mux.attached) {
+        mux.attached = true;
+        mux.reading = mux.executing = MuxLine_None;
+        mux.macro_next = true;
+        mux.stream_read = hal.stream.read;
+        hal.stream.read = stream_mux_read;
+        mux.status_message = grbl.report.status_message;
+        grbl.report.status_message = stream_mux_status;
+    }
+}
+
+// Restores the hooks if they have not been replaced by someone else since attaching.
+static void stream_mux_detach (void)
+{
+    if(mux.attached) {
+        if(hal.stream.read == stream_mux_read)
+            hal.stream.read = mux.stream_read;
+        if(grbl.report.status_message == stream_mux_status)
+            grbl.report.status_message = mux.status_message;
+        mux.attached = false;
+    }
+    is_executing = false;
+}
+
 // Ends macro execution if currently running
 // and restores normal operation.
 static void end_macro (void)
 {
-    is_executing = false;
-    if(hal.stream.read == get_macro_char) {
-        hal.stream.read = stream_read;
-        report_init_fns();
-    }
+    macro_close();
+    stream_mux_detach();
 }
 
 // Called on a soft reset so that normal operation can be restored.
@@ -165,58 +568,154 @@ static void plugin_reset (void)
 // Macro stream input function.
 // Reads character by character from the macro and returns them when
 // requested by the foreground process.
+// Refills the read-ahead window from the macro source.
+static void macro_stream_fill (void)
+{
+    macro_stream.pos = 0;
+
+    switch(macro_stream.source) {
+
+        case MacroSource_NVS:
+            macro_stream.len = macro_stream.remaining > KEYPAD_MACRO_WINDOW ? KEYPAD_MACRO_WINDOW : macro_stream.remaining;
+            if(hal.nvs.memcpy_from_nvs((uint8_t *)macro_stream.buf, macro_stream.address, macro_stream.len, false) != NVS_TransferResult_OK)
+                macro_stream.len = 0;
+            macro_stream.address += macro_stream.len;
+            macro_stream.remaining -= macro_stream.len;
+            break;
+
+#if KEYPAD_MACRO_FILES
+        case MacroSource_File:
+            macro_stream.len = vfs_read(macro_stream.buf, 1, KEYPAD_MACRO_WINDOW, macro_stream.file);
+            break;
+#endif
+
+        default:
+            macro_stream.len = 0;
+            break;
+    }
+}
+
+// Returns the next macro character, '\0' at the end of the macro.
+static char macro_stream_getc (void)
+{
+    char c;
+
+    if(macro_stream.source == MacroSource_String) {
+        if((c = *command) != '\0')
+            command++;
+    } else do {
+        if(macro_stream.pos == macro_stream.len)    // Window consumed, read ahead.
+            macro_stream_fill();
+        c = macro_stream.pos < macro_stream.len ? macro_stream.buf[macro_stream.pos++] : '\0';
+    } while(c == ASCII_CR);
+
+    return c == (char)0xFF ? '\0' : c;             // Erased NVS ends the macro.
+}
+
 static int16_t get_macro_char (void)
 {
     static bool eol_ok = false;
 
-    if(*command == '\0') {                          // End of macro?
-        end_macro();                                // If end reading from it
-        return eol_ok ? SERIAL_NO_DATA : ASCII_LF;  // and return a linefeed if the last character was not a linefeed.
-    }
+    char c;
+
+    if(mux.macro_end)
+        return SERIAL_NO_DATA;
 
-    char c = *command++;    // Get next character.
+    if((c = macro_stream_getc()) == '\0') {         // End of macro?
+        macro_close();                              // If end reading from it
+        if(eol_ok)
+            return SERIAL_NO_DATA;
+        eol_ok = true;
+        return ASCII_LF;                            // and return a linefeed if the last character was not a linefeed.
+    }
 
-    if((eol_ok = c == '|')) // If character is vertical bar
-        c = ASCII_LF;       // return a linefeed character.
+    if((eol_ok = c == '|' || c == ASCII_LF))        // If character is vertical bar or end of line
+        c = ASCII_LF;                               // return a linefeed character.
 
     return (uint16_t)c;
 }
 
-// This code will be executed after each command is sent to the parser,
-// If an error is detected macro execution will be stopped and the status_code reported.
-static status_code_t trap_status_report (status_code_t status_code)
+// Multiplexed stream input function.
+// A host line in progress always completes first, at a line boundary the macro
+// and the host take turns line by line while both have data.
+static int16_t stream_mux_read (void)
+{
+    int16_t c;
+
+    if(mux.reading != MuxLine_Macro) {
+
+        if(mux.reading == MuxLine_Host || !mux.macro_next || mux.macro_end) {
+
+            if((c = mux.stream_read()) != SERIAL_NO_DATA) {
+                if(c == ASCII_LF || c == ASCII_CR) {
+                    mux.reading = MuxLine_None;
+                    mux.executing = MuxLine_Host;
+                    mux.macro_next = true;
+                } else
+                    mux.reading = MuxLine_Host;
+                return c;
+            }
+
+            if(mux.reading == MuxLine_Host || mux.macro_end)
+                return SERIAL_NO_DATA;
+        }
+
+        mux.reading = MuxLine_Macro;
+    }
+
+    if((c = get_macro_char()) == SERIAL_NO_DATA || c == ASCII_LF) {
+        mux.reading = MuxLine_None;
+        mux.macro_next = false;
+        if(c == ASCII_LF)
+            mux.executing = MuxLine_Macro;
+        else if(mux.executing != MuxLine_Macro)   // Macro ended and no status is pending.
+            stream_mux_detach();
+    }
+
+    return c;
+}
+
+// This code will be executed after each command is sent to the parser.
+// Status of host lines is passed on, status of macro lines is trapped:
+// if an error is detected macro execution will be stopped and the status_code reported.
+static status_code_t stream_mux_status (status_code_t status_code)
 {
+    if(mux.executing != MuxLine_Macro)
+        return mux.status_message(status_code);
+
+    mux.executing = MuxLine_None;
+
     if(status_code != Status_OK) {
         char msg[30];
         sprintf(msg, "error %d in macro", (uint8_t)status_code);
-        report_message(msg, Message_Warning);
-        end_macro();
+        keypad_report_message(msg, Message_Warning);
+        macro_close();
     }
 
+    if(mux.macro_end && mux.reading != MuxLine_Macro)
+        stream_mux_detach();
+
     return status_code;
 }
 
 // Actual start of macro execution.
 static void run_macro (uint_fast16_t state)
 {
-    if(state == STATE_IDLE && hal.stream.read != get_macro_char) {
-        stream_read = hal.stream.read;                      // Redirect input stream to read from the macro instead of
-        hal.stream.read = get_macro_char;                   // the active stream. This ensures that input streams are not mingled.
-        grbl.report.status_message = trap_status_report;    // Add trap for status messages so we can terminate on errors.
-    }
+    if(state == STATE_IDLE)
+        stream_mux_attach();    // Inject the macro into the input stream, host lines are still served in between.
+    else
+        end_macro();
 }
 
-// enqueue homing command by switching input stream.
+// enqueue homing command by injecting it into the input stream.
 static void run_homing (uint_fast16_t state)
 {
     if(!is_executing && ( (state_get() == STATE_IDLE) || (state_get() == STATE_ALARM) ) ) {
         is_executing = true;
         command = "$H";
-        if (hal.stream.read != get_macro_char){
-            stream_read = hal.stream.read;
-            hal.stream.read = get_macro_char;
-            grbl.report.status_message = trap_status_report;
-        }
+        macro_stream.source = MacroSource_String;
+        mux.macro_end = false;
+        stream_mux_attach();
     }
 }
 
@@ -229,12 +728,36 @@ static void execute_macro (uint8_t macro)
 {
     if(!is_executing && state_get() == STATE_IDLE) {
         is_executing = true;
-        command = macro_plugin_settings.macro[macro].data;
-        if(!(*command == '\0' || *command == 0xFF))     // If valid command
+        mux.macro_end = false;
+        macro_stream.source = MacroSource_NVS;
+        macro_stream.address = MACRO_NVS_ADDRESS(macro) + offsetof(macro_setting_t, data);
+        macro_stream.remaining = sizeof(macro_edit.data);
+        macro_stream_fill();
+#if KEYPAD_MACRO_FILES
+        if(macro_stream.len && *macro_stream.buf == KEYPAD_MACRO_FILE_PREFIX) {    // Macro is a file reference, open it for streaming.
+            if(hal.nvs.memcpy_from_nvs((uint8_t *)&macro_edit, MACRO_NVS_ADDRESS(macro), sizeof(macro_setting_t), false) == NVS_TransferResult_OK) {
+                macro_edit.data[sizeof(macro_edit.data) - 1] = '\0';
+                macro_stream.file = vfs_open(macro_edit.data + 1, "r");
+            }
+            if(macro_stream.file == NULL) {
+                keypad_report_message("Keypad macro file not found", Message_Warning);
+                end_macro();
+                return;
+            }
+            macro_stream.source = MacroSource_File;
+            macro_stream_fill();
+        }
+#endif
+        if(macro_stream.len && !(*macro_stream.buf == '\0' || *macro_stream.buf == (char)0xFF))   // If valid command
             protocol_enqueue_rt_command(run_macro);     // register run_macro function to be called from foreground process.
+        else
+            end_macro();
     }
 }
 
+static bool jog_submit (char *cmd, uint32_t bits, float distance, uint_fast8_t decimals, uint_fast16_t gen);
+static float jog_limit_distance (uint32_t bits, float distance);
+
 static void keypad_settings_save (void)
 {
     hal.nvs.memcpy_to_nvs(keypad_nvs_address, (uint8_t *)&jog, sizeof(jog_settings_t), true);
@@ -270,42 +793,102 @@ static setting_details_t keypad_setting_details = {
     .save = keypad_settings_save
 };
 
+// Reads a macro slot into the scratch buffer, settings are fetched from NVS on demand.
+// Single slots are read without the checksum, it covers the whole block and is verified on load.
+static char *macro_get (setting_id_t id)
+{
+    uint_fast8_t idx = id - Setting_UserDefined_0;
+
+    if(macro_block)
+        memcpy(&macro_edit, &macro_block->macro[idx], sizeof(macro_setting_t));
+    else if(hal.nvs.memcpy_from_nvs((uint8_t *)&macro_edit, MACRO_NVS_ADDRESS(idx), sizeof(macro_setting_t), false) != NVS_TransferResult_OK)
+        *macro_edit.data = '\0';
+
+    macro_edit.data[sizeof(macro_edit.data) - 1] = '\0';
+
+    return macro_edit.data;
+}
+
+// Releases the block with pending edits.
+static void macro_block_free (void)
+{
+    if(macro_block) {
+        free(macro_block);
+        macro_block = NULL;
+    }
+}
+
+// The block written on save is allocated and read here, not in macro_settings_save(),
+// so that running out of memory is returned as the setting status instead of silently dropping the edit.
+static status_code_t macro_set (setting_id_t id, char *value)
+{
+    uint_fast8_t idx = id - Setting_UserDefined_0;
+
+    if(strlen(value) >= sizeof(macro_edit.data))
+        return Status_SettingValueOutOfRange;
+
+    if(macro_block == NULL) {
+
+        if((macro_block = malloc(sizeof(macro_settings_t))) == NULL)
+            return Status_Overflow;
+
+        if(hal.nvs.memcpy_from_nvs((uint8_t *)macro_block, macro_nvs_address, sizeof(macro_settings_t), false) != NVS_TransferResult_OK) {
+            macro_block_free();
+            return Status_SettingReadFail;
+        }
+    }
+
+    macro_block->macro[idx].port = 0;
+    strcpy(macro_block->macro[idx].data, value);
+
+    return Status_OK;
+}
+
 // Write settings to non volatile storage (NVS).
+// The whole block is written back so that the checksum covers all slots.
 static void macro_settings_save (void)
 {
-    hal.nvs.memcpy_to_nvs(macro_nvs_address, (uint8_t *)&macro_plugin_settings, sizeof(macro_settings_t), true);
+    if(macro_block) {
+        hal.nvs.memcpy_to_nvs(macro_nvs_address, (uint8_t *)macro_block, sizeof(macro_settings_t), true);
+        macro_block_free();
+    }
 }
 
 static void macro_settings_restore (void)
-{   
+{
     uint_fast8_t idx;
-    uint_fast8_t idy;
-    char default_str[] = "G4P0";
-
-    // Register empty macro strings.
-    for(idx = 0; idx < N_MACROS; idx++) {
-            for(idy = 0; idy < strlen(default_str); idy++) {
-                macro_plugin_settings.macro[idx].data[idy] = default_str[idy];
-            };
-            macro_plugin_settings.macro[idx].data[idy] = '\0';
-    };
-    
-    //removed the special spindle macro.
-    /*char cmd_str[] = "S200M03";
+    macro_settings_t *macros;
 
-    for(idx = 0; idx < strlen(cmd_str); idx++) {
-        macro_plugin_settings.macro[4].data[idx] = cmd_str[idx];
-    };
-    macro_plugin_settings.macro[4].data[idx] = '\0'; */
+    macro_block_free();
+
+    if((macros = malloc(sizeof(macro_settings_t)))) {
 
-    hal.nvs.memcpy_to_nvs(macro_nvs_address, (uint8_t *)&macro_plugin_settings, sizeof(macro_settings_t), true);
+        memset(macros, 0, sizeof(macro_settings_t));
 
+        for(idx = 0; idx < N_MACROS; idx++)
+            strcpy(macros->macro[idx].data, "G4P0");
+
+        hal.nvs.memcpy_to_nvs(macro_nvs_address, (uint8_t *)macros, sizeof(macro_settings_t), true);
+        free(macros);
+    }
 }
 
+// Only verifies the block, macros are read from NVS when used.
+// Verification is skipped if there is no memory for the transient buffer.
 static void macro_settings_load (void)
 {
-    if(hal.nvs.memcpy_from_nvs((uint8_t *)&macro_plugin_settings, macro_nvs_address, sizeof(macro_settings_t), true) != NVS_TransferResult_OK)
-        macro_settings_restore();   
+    bool ok = true;
+    macro_settings_t *macros;
+
+    macro_block_free();
+
+    if((macros = malloc(sizeof(macro_settings_t)))) {
+        ok = hal.nvs.memcpy_from_nvs((uint8_t *)macros, macro_nvs_address, sizeof(macro_settings_t), true) == NVS_TransferResult_OK;
+        free(macros);
+    }
+
+    if(!ok)
+        macro_settings_restore();
 }
 
 // Settings descriptor used by the core when interacting with this plugin.
@@ -321,6 +904,81 @@ static setting_details_t macro_setting_details = {
     .restore = macro_settings_restore
 };
 
+// Schedules a task to run at or after the deadline, replaces any pending deadline.
+// Must only be called from the context running the task, see TASK_CONTEXT().
+static void task_schedule (keypad_task_id_t id, uint32_t deadline)
+{
+    tasks[id].deadline = deadline;
+    tasks[id].active = true;
+
+    if((int32_t)(deadline - next_deadline[TASK_CONTEXT(id)]) < 0)
+        next_deadline[TASK_CONTEXT(id)] = deadline;
+}
+
+// Requests a task to run as soon as possible, may be called from either context.
+static void task_request (keypad_task_id_t id)
+{
+#if KEYPAD_IO_TASK
+    __atomic_store_n(&task_requests[id], true, __ATOMIC_SEQ_CST);
+#else
+    task_schedule(id, hal.get_elapsed_ticks());
+#endif
+}
+
+// Enqueues a realtime command from interrupt context, 'H' starts homing.
+// grbl.enqueue_realtime_command() is interrupt safe and is called directly so that reset, unlock and
+// jog cancel take effect even if the protocol loop does not run normally, e.g. in estop. With the I/O task
+// enabled homing is passed to the protocol loop as the interrupt may run on the I/O core.
+ISR_CODE static void ISR_FUNC(keypad_rt_command)(char c)
+{
+    if(c != 'H')
+        grbl.enqueue_realtime_command(c);
+    else {
+#if KEYPAD_IO_TASK
+        uint_fast8_t bptr = (actionq.head + 1) & (KEYPAD_ACTION_QUEUE - 1);
+
+        if(bptr != actionq.tail) {
+            actionq.cmd[actionq.head] = c;
+            __sync_synchronize();
+            actionq.head = bptr;
+        }
+#else
+        protocol_enqueue_rt_command(run_homing);
+#endif
+    }
+}
+
+// Queues a message for the pendant, it is dropped if the queue is full.
+static void message_enqueue (const char *text, message_type_t type)
+{
+    uint_fast8_t bptr = (msgqueue.head + 1) & (KEYPAD_MSG_QUEUE - 1);
+
+    if(bptr != msgqueue.tail) {
+        msgqueue.msg[msgqueue.head].type = type;
+        strncpy(msgqueue.msg[msgqueue.head].text, text, KEYPAD_MSG_LENGTH);
+        msgqueue.msg[msgqueue.head].text[KEYPAD_MSG_LENGTH] = '\0';
+        __sync_synchronize();
+        msgqueue.head = bptr;
+        if(!tasks[Task_Message].active)
+            task_request(Task_Message);
+    }
+}
+
+// Reports a message to the host and the pendant.
+static void keypad_report_message (const char *msg, message_type_t type)
+{
+    report_message(msg, type);
+    message_enqueue(msg, type);
+}
+
+// Returns the next keycode without removing it, 0 if no keycode enqueued
+static char keypad_peek_keycode (void)
+{
+    uint32_t bptr = keybuf.tail;
+
+    return bptr != keybuf.head ? keybuf.buf[bptr] : '\0';
+}
+
 // Returns 0 if no keycode enqueued
 static char keypad_get_keycode (void)
 {
@@ -350,7 +1008,7 @@ static char *strrepl (char *str, int c, char *str3)
     return str;
 }
 
-static char *map_coord_system (coord_system_id_t id)
+static char *map_coord_system (char *buf, coord_system_id_t id)
 {
     uint8_t g5x = id + 54;
 
@@ -385,151 +1043,659 @@ static bool onSpindleSelect (spindle_ptrs_t *spindle)
     return on_spindle_select == NULL || on_spindle_select(spindle);
 }
 
-static void send_status_info (void)
-{    
-    int32_t current_position[N_AXIS]; // Copy current state of the system position variable
-    float jog_modifier = 0;
-    float print_position[N_AXIS];
-    status_packet.a_coordinate = 0xffff;
+// Derives per axis velocities from the direction of the block being executed
+// and the realtime feed rate.
+static void get_velocity (float *velocity, float rate)
+{
+    uint_fast8_t idx;
+    float length = 0.0f;
+    plan_block_t *block = rate > 0.0f ? plan_get_current_block() : NULL;
 
-    spindle_ptrs_t *spindle;
-    spindle_state_t spindle_state;
+    for(idx = 0; idx < N_AXIS; idx++) {
+        velocity[idx] = block ? (float)block->steps[idx] / settings.axis[idx].steps_per_mm : 0.0f;
+        length += velocity[idx] * velocity[idx];
+    }
 
-    static uint32_t last_ms;
-    uint32_t ms = hal.get_elapsed_ticks();
+    if(length > 0.0f) {
+        rate /= sqrtf(length);
+        for(idx = 0; idx < N_AXIS; idx++) {
+            velocity[idx] *= rate;
+            if(block->direction_bits.mask & bit(idx))
+                velocity[idx] = -velocity[idx];
+        }
+    }
+}
 
-    if(ms < last_ms + 10) // don't spam the port
-    return;
-    
-    memcpy(current_position, sys.position, sizeof(sys.position));
+// Copies the step position, retrying until two consecutive copies match
+// so that all axes are from the same step interrupt tick.
+static void get_position (int32_t *position)
+{
+    uint_fast8_t retries = 3;
+    int32_t check[N_AXIS];
 
-    system_convert_array_steps_to_mpos(print_position, current_position);
+    memcpy(position, sys.position, sizeof(sys.position));
 
-    uint_fast8_t idx;
-    float wco[N_AXIS];
-    for (idx = 0; idx < N_AXIS; idx++) {
-        // Apply work coordinate offsets and tool length offset to current position.
-        wco[idx] = gc_get_offset(idx,0);
-        print_position[idx] -= wco[idx];
-    }  
-    
-    status_packet.address = 0x01;
-    
-    switch(jogModify){
-        case JogModify_1:
-            jog_modifier = 1;
-        break;
-        case JogModify_01:
-            jog_modifier = 0.1;                    
-        break;
-        case JogModify_001:
-            jog_modifier = 0.01;                    
-        break;  
-    }
-    
-    switch (state_get()){
-        case STATE_ALARM:
-            status_packet.machine_state.state = 1;
-            break;
-        case STATE_ESTOP:
-            status_packet.machine_state.state = 1;
-            break;            
-        case STATE_CYCLE:
-            status_packet.machine_state.state = 2;
-            break;
-        case STATE_HOLD:
-            status_packet.machine_state.state = 3;
+    do {
+        memcpy(check, sys.position, sizeof(sys.position));
+        if(memcmp(check, position, sizeof(sys.position)) == 0)
             break;
-        case STATE_TOOL_CHANGE:
-            status_packet.machine_state.state = 4;
-            break;
-        case STATE_IDLE:
-            status_packet.machine_state.state = 5;
-            break;
-        case STATE_HOMING:
-            status_packet.machine_state.state = 6;
-            break;   
-        case STATE_JOG:
-            status_packet.machine_state.state = 7;
-            break;                                    
-        default :
-            status_packet.machine_state.state = 0x0F;
-            break;                                                        
-    }
+        memcpy(position, check, sizeof(sys.position));
+    } while(--retries);
+}
 
-    status_packet.machine_state.mode = settings.mode;
-    status_packet.machine_state.disconnected = 0;
+// Status snapshot stages, see status_snapshot_take().
 
-    //check the probe pin, if it is asserted, add it to the state
+// Samples the step position together with the state and motion, the fields that change
+// while moving, so that they are from the same pass. Conversion is left to status_take_position().
+static void status_take_motion (status_snapshot_t *snap, int32_t *steps, uint32_t ms)
+{
+    get_position(steps);
 
-    status_packet.coolant_state = hal.coolant.get_state();
-    status_packet.feed_override = sys.override.feed_rate;
+    snap->state = state_get();
+    snap->alarm = (uint8_t)sys.alarm;
+    snap->feed_rate = st_get_realtime_rate();
+    get_velocity(snap->velocity, snap->feed_rate);
+    snap->timestamp = ms;
+}
 
-    spindle = spindle_get(0);
+static void status_take_position (status_snapshot_t *snap, int32_t *steps)
+{
+    uint_fast8_t idx;
 
-    if(spindle->get_state)
-        spindle_state = spindle->get_state(spindle);
+    system_convert_array_steps_to_mpos(snap->position, steps);
+
+    for (idx = 0; idx < N_AXIS; idx++) {
+        // Apply work coordinate offsets and tool length offset to current position.
+        snap->position[idx] -= gc_get_offset(idx, 0);
+    }
+}
+
+static void status_take_machine (status_snapshot_t *snap)
+{
+    float jog_modifier = jog_modify_factor[jogModify];
+
+    snap->mode = settings.mode;
+    snap->disconnected = pendant_link.disconnected;
+    snap->home_state = (uint8_t)(sys.homing.mask & sys.homed.mask);
+    snap->coolant_state = hal.coolant.get_state();
+    snap->feed_override = sys.override.feed_rate;
+    snap->current_wcs = gc_state.modal.coord_system.id;
+    snap->jog_mode = (uint8_t)jogMode << 4 | (uint8_t)jogModify;
 
-    if(spindle->cap.variable) {
-        status_packet.spindle_rpm = spindle_state.on ? lroundf(spindle->param->rpm_overridden) : 0;
-        if(spindle->get_data)
-            status_packet.spindle_rpm = spindle->get_data(SpindleData_RPM)->rpm;
-    } else
-        status_packet.spindle_rpm = spindle->param->rpm;
-
-    status_packet.spindle_override = (uint32_t)spindle->param->override_pct;
-    status_packet.spindle_stop = spindle_state.on;        
-
-    status_packet.feed_rate = st_get_realtime_rate();
-
-    status_packet.alarm = (uint8_t) sys.alarm;
-    status_packet.home_state = (uint8_t)(sys.homing.mask & sys.homed.mask);
-    status_packet.jog_mode = (uint8_t) jogMode << 4 | (uint8_t) jogModify;
-    status_packet.x_coordinate = print_position[0];
-    status_packet.y_coordinate = print_position[1];
-    status_packet.z_coordinate = print_position[2];
-    #if N_AXIS > 3
-    status_packet.a_coordinate = print_position[3];
-    #else
-    status_packet.a_coordinate = 0xFFFFFFFF;
-    #endif
-
-    status_packet.feed_rate = st_get_realtime_rate();
-    
     switch(jogMode){
         case JogMode_Slow:
-        status_packet.jog_stepsize = jog.slow_speed * jog_modifier;
+        snap->jog_stepsize = jog.slow_speed * jog_modifier;
         break;
         case JogMode_Fast:
-        status_packet.jog_stepsize = jog.fast_speed * jog_modifier;
+        snap->jog_stepsize = jog.fast_speed * jog_modifier;
         break;
         default:
-        status_packet.jog_stepsize = jog.step_distance * jog_modifier;
+        snap->jog_stepsize = jog.step_distance * jog_modifier;
         break;
     }
-    
-    status_packet.current_wcs = gc_state.modal.coord_system.id;       
-
-    i2c_send (KEYPAD_I2CADDR, status_ptr, sizeof(Machine_status_packet), 0); 
+}
 
-    last_ms = ms;   
+// Spindle state is taken from the spindle parameters and the actual RPM from the cache, see keypad_spindle_task().
+// The programmed RPM is reported until the cache has been refreshed, e.g. just after the spindle was started.
+static void status_take_spindle (status_snapshot_t *snap)
+{
+    spindle_ptrs_t *spindle = spindle_get(0);
+    bool on = spindle->param->state.on;
+
+    if(!spindle->cap.variable)
+        snap->spindle_rpm = spindle->param->rpm;
+    else if(!on)
+        snap->spindle_rpm = 0;
+    else if(spindle->get_data && snap->timestamp - spindle_cache.timestamp <= 2 * KEYPAD_SPINDLE_RATE)
+        snap->spindle_rpm = spindle_cache.rpm;
+    else
+        snap->spindle_rpm = lroundf(spindle->param->rpm_overridden);
+
+    snap->spindle_override = (uint8_t)spindle->param->override_pct;
+    snap->spindle_stop = on;
 }
 
-static void keypad_process_keypress (sys_state_t state)
+// Takes a snapshot of all live state reported to the pendant in one go.
+static void status_snapshot_take (status_snapshot_t *snap, uint32_t ms)
 {
-    bool addedGcode, jogCommand = false;
-    char command[35] = "", keycode = keypad_get_keycode();
-    float jog_modifier = 0;
+    int32_t steps[N_AXIS];
 
-    spindle_state_t spindle_state;
+    status_take_motion(snap, steps, ms);
+    status_take_position(snap, steps);
+    status_take_machine(snap);
+    status_take_spindle(snap);
+}
 
-    //if(state == STATE_ESTOP)
-    //    return;
+// Pendant state codes indexed by the position of the sys_state_t state bit plus one, STATE_IDLE
+// is at index 0. The last entry is used for states without a code.
+static const uint8_t state_code[] = {
+    5,      // STATE_IDLE
+    1,      // STATE_ALARM
+    0x0F,   // STATE_CHECK_MODE
+    6,      // STATE_HOMING
+    2,      // STATE_CYCLE
+    3,      // STATE_HOLD
+    7,      // STATE_JOG
+    0x0F,   // STATE_SAFETY_DOOR
+    0x0F,   // STATE_SLEEP
+    1,      // STATE_ESTOP
+    4,      // STATE_TOOL_CHANGE
+    0x0F
+};
 
-    if(keycode) {
+typedef struct {
+    uint8_t frame;  // offset in Machine_status_packet
+    uint8_t snap;   // offset in status_snapshot_t
+    uint8_t size;
+} status_field_t;
+
+// Status frame fields copied from the snapshot, snapshot fields must be of the same type as
+// the frame fields. The machine state is set by status_pack(), other fields from status_frame.
+// The size check is wrapped in a struct so that it can be used in an initializer.
+#define STATUS_FIELD_SIZE(f, s) (sizeof(struct { \
+    _Static_assert(sizeof(((Machine_status_packet *)0)->f) == sizeof(((status_snapshot_t *)0)->s), "status field " #f " size mismatch"); \
+    char c; }) * 0 + sizeof(((Machine_status_packet *)0)->f))
+#define STATUS_FIELD(f, s) { offsetof(Machine_status_packet, f), offsetof(status_snapshot_t, s), STATUS_FIELD_SIZE(f, s) }
+
+static const status_field_t status_fields[] = {
+    STATUS_FIELD(alarm, alarm),
+    STATUS_FIELD(home_state, home_state),
+    STATUS_FIELD(feed_override, feed_override),
+    STATUS_FIELD(spindle_override, spindle_override),
+    STATUS_FIELD(spindle_stop, spindle_stop),
+    STATUS_FIELD(spindle_rpm, spindle_rpm),
+    STATUS_FIELD(feed_rate, feed_rate),
+    STATUS_FIELD(coolant_state, coolant_state),
+    STATUS_FIELD(jog_mode, jog_mode),
+    STATUS_FIELD(jog_stepsize, jog_stepsize),
+    STATUS_FIELD(current_wcs, current_wcs),
+    STATUS_FIELD(x_coordinate, position[X_AXIS]),
+    STATUS_FIELD(y_coordinate, position[Y_AXIS]),
+    STATUS_FIELD(z_coordinate, position[Z_AXIS]),
+    STATUS_FIELD(timestamp, timestamp),
+    STATUS_FIELD(x_velocity, velocity[X_AXIS]),
+    STATUS_FIELD(y_velocity, velocity[Y_AXIS]),
+    STATUS_FIELD(z_velocity, velocity[Z_AXIS]),
+#if N_AXIS > 3
+    STATUS_FIELD(a_coordinate, position[A_AXIS]),
+    STATUS_FIELD(a_velocity, velocity[A_AXIS])
+#endif
+};
 
-        if(keypad.on_keypress_preview && keypad.on_keypress_preview(keycode, state))
+// Initial content of every status frame.
+static const Machine_status_packet status_frame = {
+    .address = 0x01,
+#if N_AXIS <= 3
+    .a_coordinate = 0xFFFFFFFF,
+    .a_velocity = 0.0f
+#endif
+};
+
+// Packs a snapshot into a status frame.
+static void status_pack (Machine_status_packet *packet, const status_snapshot_t *snap)
+{
+    uint_fast8_t idx;
+
+    memcpy(packet, &status_frame, sizeof(Machine_status_packet));
+
+    for(idx = 0; idx < sizeof(status_fields) / sizeof(status_field_t); idx++)
+        memcpy((uint8_t *)packet + status_fields[idx].frame, (const uint8_t *)snap + status_fields[idx].snap, status_fields[idx].size);
+
+    packet->machine_state.state = state_code[min((uint_fast8_t)__builtin_ffs(snap->state), sizeof(state_code) - 1)];
+    packet->machine_state.mode = snap->mode;
+    packet->machine_state.disconnected = snap->disconnected;
+}
+
+// CRC-16/CCITT-FALSE, polynomial 0x1021 and initial value 0xFFFF.
+static uint16_t crc16 (const uint8_t *data, size_t len)
+{
+    uint_fast8_t idx;
+    uint16_t crc = 0xFFFF;
+
+    while(len--) {
+        crc ^= (uint16_t)*data++ << 8;
+        for(idx = 0; idx < 8; idx++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+
+    return crc;
+}
+
+// Sends the current status frame. A failed transaction is retried once, on the next
+// pass of keypad_poll() so that the bus has time to recover.
+static void status_transmit (bool retry)
+{
+    if(retry)
+        pendant_link.retried++;
+
+    pendant_link.sent++;
+    pendant_link.retry = false;
+
+    if(!i2c_send(KEYPAD_I2CADDR, (uint8_t *)&status_packet, sizeof(Machine_status_packet), 0)) {
+        pendant_link.failed++;
+        pendant_link.retry = !retry;
+    }
+}
+
+// Packs a snapshot into the status frame and sends it to the pendant.
+static void status_send (const status_snapshot_t *snap)
+{
+    status_pack(&status_packet, snap);
+    status_packet.sequence = ++pendant_link.sequence;
+    status_packet.crc = crc16((uint8_t *)&status_packet, offsetof(Machine_status_packet, crc));
+    pendant_link.frame_valid = true;
+
+    status_transmit(false);
+}
+
+// Hands an assembled snapshot over for sending, to the I/O task when enabled.
+// The snapshot is dropped if the I/O task has fallen behind.
+static void status_publish (const status_snapshot_t *snap)
+{
+#if KEYPAD_IO_TASK
+    uint_fast8_t bptr = (snapq.head + 1) & (KEYPAD_SNAPSHOT_QUEUE - 1);
+
+    if(bptr != snapq.tail) {
+        memcpy(&snapq.snap[snapq.head], snap, sizeof(status_snapshot_t));
+        __sync_synchronize();   // Snapshot must be visible before it is published.
+        snapq.head = bptr;
+    }
+#else
+    status_send(snap);
+#endif
+}
+
+// Resends the last status frame on request or after a failed transaction.
+static void status_resend (void)
+{
+    if(pendant_link.resend || pendant_link.retry) {
+        pendant_link.resend = false;
+        if(pendant_link.frame_valid)
+            status_transmit(true);
+        else
+            pendant_link.retry = false;
+    }
+}
+
+// Returns true if a status frame is being assembled, is queued or is due within KEYPAD_MSG_PAGE_DELAY ms.
+static bool status_busy (uint32_t ms)
+{
+#if KEYPAD_IO_TASK
+    return snapq.tail != snapq.head;
+#else
+    return status_build.stage != StatusStage_Idle ||
+            (tasks[Task_Status].active && (int32_t)(tasks[Task_Status].deadline - ms) < KEYPAD_MSG_PAGE_DELAY);
+#endif
+}
+
+// Requests a status frame, it is assembled in stages by keypad_status_build_task().
+// Requests made while a frame is being assembled result in a new frame when done.
+static void send_status_info (void)
+{
+    uint32_t ms = hal.get_elapsed_ticks();
+
+    if(status_build.stage == StatusStage_Idle) {
+        status_build.stage = StatusStage_Motion;
+        if((int32_t)(ms - (status_build.last_ms + 10)) < 0) // don't spam the port
+            ms = status_build.last_ms + 10;
+        task_schedule(Task_StatusBuild, ms);
+    } else
+        status_build.pending = true;
+}
+
+// Cancels the jog in progress. If a jog is being handed to the core or waiting to
+// start it is cancelled by onStateChanged() as soon as the core reports STATE_JOG.
+ISR_CODE static void ISR_FUNC(jog_cancel)(void)
+{
+    if(shared_xchg(&jog_state, JogState_Cancelling) == JogState_Active)
+        keypad_rt_command(CMD_JOG_CANCEL);
+}
+
+// Cancels the jog in progress from the foreground process.
+static void jog_stop (void)
+{
+    if(shared_xchg(&jog_state, JogState_Cancelling) == JogState_Active)
+        grbl.enqueue_realtime_command(CMD_JOG_CANCEL);
+}
+
+// Called on key release from interrupt context.
+ISR_CODE static void ISR_FUNC(jog_release)(void)
+{
+    __atomic_fetch_add(&jog_release_gen, 1, __ATOMIC_SEQ_CST); // Called from more than one interrupt handler.
+    keyreleased = true;
+    keyrepeat.keycode = '\0';
+    jog_cancel();
+}
+
+// Returns true if the key has been released after the generation gen was sampled.
+// keyreleased is read before the generation so that a release between the two reads is seen,
+// the result is to be used for a single decision.
+static inline bool jog_released (uint_fast16_t gen)
+{
+    bool released = keyreleased;
+
+    return released || gen != jog_release_gen;
+}
+
+// Queues a jog command for jog_dispatch(), replaces a command not yet handed to the core.
+// cmd has ? in place of the distance along the directions in bits.
+// The command is dropped if the key has been released after the generation gen was sampled.
+static bool jog_submit (char *cmd, uint32_t bits, float distance, uint_fast8_t decimals, uint_fast16_t gen)
+{
+    if(jog_released(gen))
+        return false;
+
+    strncpy(jog_pending.line, cmd, JOG_LINE_SIZE - 1);
+    jog_pending.line[JOG_LINE_SIZE - 1] = '\0';
+    jog_pending.bits = bits;
+    jog_pending.distance = distance;
+    jog_pending.decimals = decimals;
+    jog_pending.gen = gen;
+
+    return true;
+}
+
+// Returns true while a jog is queued, waiting to start or running.
+static inline bool jog_busy (void)
+{
+    return *jog_pending.line != '\0' || jog_pending.awaiting || state_get() == STATE_JOG;
+}
+
+// Hands the queued jog command to the core when no jog is waiting to start or running,
+// called from the foreground process on every pass. grbl.enqueue_gcode() only copies
+// the command, the jog becomes Active when the core reports STATE_JOG for it.
+// A release that happens after the generation was sampled, before or during the hand over,
+// results in the command being dropped or in the jog being cancelled as soon as it starts.
+// The distance is clipped to the soft limits right before the hand over, using the position
+// the previous jog stopped at rather than the one when the command was queued.
+static void jog_dispatch (void)
+{
+    uint32_t ms;
+    float distance = 0.0f;
+    char line[JOG_LINE_SIZE];
+
+    if(*jog_pending.line == '\0' && !jog_pending.awaiting)
+        return;
+
+    ms = hal.get_elapsed_ticks();
+
+    if(jog_pending.awaiting) {
+        if(ms - jog_pending.submitted < JOG_START_TIMEOUT)
             return;
+        jog_pending.awaiting = false;   // Command rejected by the core.
+        shared_xchg(&jog_state, JogState_Idle);
+    }
+
+    if(*jog_pending.line == '\0' || state_get() == STATE_JOG)
+        return;
+
+    if(jog_released(jog_pending.gen)) {
+        *jog_pending.line = '\0';      // Released before it was handed over.
+        return;
+    }
+
+    // No jog of ours is in flight, any earlier state is stale.
+    shared_xchg(&jog_state, JogState_Requested);
+
+    if(jog_released(jog_pending.gen) ||
+        (distance = jog_limit_distance(jog_pending.bits, jog_pending.distance)) == 0.0f) {
+        *jog_pending.line = '\0';      // Released or at the soft limit.
+        shared_xchg(&jog_state, JogState_Idle);
+        return;
+    }
+
+    strcpy(line, jog_pending.line);
+    strrepl(line, '?', ftoa(distance, jog_pending.decimals));
+
+    if(grbl.enqueue_gcode(line)) {
+        *jog_pending.line = '\0';
+        jog_pending.submitted = ms;
+        jog_pending.awaiting = true;
+        if(shared_xchg(&jog_state, JogState_Pending) == JogState_Cancelling)
+            shared_xchg(&jog_state, JogState_Cancelling);  // Released while handing over, cancel on start.
+    } else if(shared_xchg(&jog_state, JogState_Idle) == JogState_Cancelling)
+        *jog_pending.line = '\0';      // Core busy and released meanwhile.
+}
+
+// Returns the JOG_VECTOR style direction bitmap for a jog keycode, 0 if not a jog keycode.
+static uint32_t jog_keycode_bits (char keycode)
+{
+    switch(keycode) {
+        case JOG_XR:   return 0x01;
+        case JOG_XL:   return 0x02;
+        case JOG_YF:   return 0x04;
+        case JOG_YB:   return 0x08;
+        case JOG_ZU:   return 0x10;
+        case JOG_ZD:   return 0x20;
+        case JOG_XRYF: return 0x05;
+        case JOG_XRYB: return 0x09;
+        case JOG_XLYF: return 0x06;
+        case JOG_XLYB: return 0x0A;
+        case JOG_XRZU: return 0x11;
+        case JOG_XRZD: return 0x21;
+        case JOG_XLZU: return 0x12;
+        case JOG_XLZD: return 0x22;
+#if N_AXIS > 3
+        case MACRORAISE: return 0x40;
+        case MACROLOWER: return 0x80;
+#endif
+    }
+
+    return 0;
+}
+
+// Clips the per axis jog distance to the remaining travel inside the soft limit
+// envelope along the jog direction so that the jog ends at the envelope.
+// Axes that are not homed are not limited.
+static float jog_limit_distance (uint32_t bits, float distance)
+{
+    uint_fast8_t idx;
+    int32_t steps[N_AXIS];
+    float position[N_AXIS], travel;
+
+    if(!settings.limits.flags.soft_enabled)
+        return distance;
+
+    get_position(steps);
+    system_convert_array_steps_to_mpos(position, steps);
+
+    for(idx = 0; idx < N_AXIS; idx++) {
+
+        if(!(sys.homed.mask & bit(idx)))
+            continue;
+
+        if(bits & (0x01 << (idx * 2)))
+            travel = sys.work_envelope.max.values[idx] - position[idx];
+        else if(bits & (0x02 << (idx * 2)))
+            travel = position[idx] - sys.work_envelope.min.values[idx];
+        else
+            continue;
+
+        if(travel < distance)
+            distance = travel;
+    }
+
+    // Round down so that the formatted target never ends up outside the envelope.
+    return distance > 0.0f ? floorf(distance * 1000.0f) / 1000.0f : 0.0f;
+}
+
+// Builds a single jog command for all axes in the bitmap, the feed rate applies along the vector.
+// Continuous jogs use a unit vector scaled to the jog distance, step jogs step each axis.
+// The per axis distance is returned in distance_out, the command has ? in its place.
+static bool jog_vector_command (char *cmd, uint32_t bits, float *distance_out)
+{
+    static const char axis_letters[] = "XYZABC";
+
+    uint_fast8_t idx, n_axes = 0;
+    int_fast8_t dir[N_AXIS];
+    float distance, speed, jog_modifier = jog_modify_factor[jogModify];
+
+    for(idx = 0; idx < N_AXIS; idx++) {
+        dir[idx] = (int_fast8_t)((bits >> (idx * 2)) & 0x01) - (int_fast8_t)((bits >> (idx * 2 + 1)) & 0x01);
+        if(dir[idx])
+            n_axes++;
+    }
+
+    if(n_axes == 0)
+        return false;
+
+    switch(jogMode) {
+        case JogMode_Slow:
+            distance = jog.slow_distance / sqrtf((float)n_axes);
+            speed = jog.slow_speed * jog_modifier;
+            break;
+
+        case JogMode_Step:
+            distance = jog.step_distance * jog_modifier;
+            speed = jog.step_speed;
+            break;
+
+        default:
+            distance = jog.fast_distance / sqrtf((float)n_axes);
+            speed = jog.fast_speed * jog_modifier;
+            break;
+    }
+
+    *distance_out = distance;
+
+    strcpy(cmd, "$J=G91G21");
+
+    for(idx = 0; idx < N_AXIS; idx++) {
+        if(dir[idx]) {
+            cmd = strchr(cmd, '\0');
+            *cmd++ = axis_letters[idx];
+            strcpy(cmd, dir[idx] < 0 ? "-?" : "?");
+        }
+    }
+
+    strcat(strcat(cmd, "F"), ftoa(speed, 0));
+
+    return true;
+}
+
+// Called from the foreground process when a new key state bitmap has been received,
+// cancels the jog in progress if the bitmap changed and schedules the new jog.
+static void keypad_process_jog_vector (sys_state_t state)
+{
+    uint32_t bits = jog_vector.bits;
+    uint_fast16_t js = jog_state;
+
+    // A resent bitmap does not restart a jog along the same vector that is queued, being started or running.
+    if(bits && bits == jog_vector.active &&
+        (js == JogState_Requested || js == JogState_Pending || js == JogState_Active || *jog_pending.line != '\0'))
+        return;
+
+    jog_stop();
+
+    jog_vector.active = 0;
+
+    if(bits)
+        task_schedule(Task_JogVector, hal.get_elapsed_ticks());
+}
+
+// Queues the jog for the current bitmap, it is started when the previous jog has ended.
+static void keypad_jog_vector_task (uint32_t ms)
+{
+    char cmd[JOG_LINE_SIZE];
+    float distance;
+    uint32_t bits = jog_vector.bits;
+
+    if(bits == 0 || jog_released(jog_vector.gen) || jog_state == JogState_Active)
+        return;
+
+    if(jog_vector_command(cmd, bits, &distance) &&
+        jog_submit(cmd, bits, distance, gc_state.modal.units_imperial ? 4 : 3, jog_vector.gen))
+        jog_vector.active = bits;
+}
+
+// Collects the key state bitmap following a JOG_VECTOR keycode.
+// Returns true if the character was consumed. A character that is not a valid bitmap
+// byte or arrives too late discards the partial bitmap and is processed as a keycode.
+ISR_CODE static bool ISR_FUNC(jog_vector_collect)(char c)
+{
+    uint32_t ms = hal.get_elapsed_ticks();
+
+    if(jog_vector.rx_count && ((c & 0x80) || c == RESET || ms - jog_vector.rx_time > JOG_VECTOR_TIMEOUT))
+        jog_vector.rx_count = 0;
+
+    jog_vector.rx_time = ms;
+
+    if(jog_vector.rx_count == 0) {
+        if(c != JOG_VECTOR)
+            return false;
+        jog_vector.rx_bits = 0;
+        jog_vector.rx_count = JOG_VECTOR_BYTES;
+    } else {
+        jog_vector.rx_bits |= (uint32_t)(c & 0x7F) << ((JOG_VECTOR_BYTES - jog_vector.rx_count) * 7);
+        if(--jog_vector.rx_count == 0) {
+            if((jog_vector.bits = jog_vector.rx_bits) == 0)
+                jog_release();
+            else {
+                jog_vector.gen = jog_release_gen;
+                keyreleased = false;
+            }
+#if KEYPAD_IO_TASK
+            jog_vector.changed = true;
+#else
+            protocol_enqueue_rt_command(keypad_process_jog_vector);
+#endif
+        }
+    }
+
+    return true;
+}
+
+// Returns true if the keycode should auto-repeat while the key is held.
+static bool keypad_is_repeatable (char keycode)
+{
+    switch(keycode) {
+
+        case CMD_OVERRIDE_FEED_FINE_PLUS:
+        case CMD_OVERRIDE_FEED_FINE_MINUS:
+        case CMD_OVERRIDE_SPINDLE_FINE_PLUS:
+        case CMD_OVERRIDE_SPINDLE_FINE_MINUS:
+            return true;
+
+        case JOG_XR:
+        case JOG_XL:
+        case JOG_YF:
+        case JOG_YB:
+        case JOG_ZU:
+        case JOG_ZD:
+        case JOG_XRYF:
+        case JOG_XRYB:
+        case JOG_XLYF:
+        case JOG_XLYB:
+        case JOG_XRZU:
+        case JOG_XRZD:
+        case JOG_XLZU:
+        case JOG_XLZD:
+#if N_AXIS > 3
+        case MACRORAISE:
+        case MACROLOWER:
+#endif
+            return jogMode == JogMode_Step;
+    }
+
+    return false;
+}
+
+// Processes a keycode, gen is the release generation sampled before the keycode was read.
+// count is the number of identical step jog keycodes merged into this one.
+static bool keypad_process_keycode (char keycode, sys_state_t state, uint_fast16_t gen, uint_fast8_t count)
+{
+    bool jogCommand = false;
+    char command[48] = "";
+    float jog_modifier = 0, distance = 0.0f;
+    uint_fast8_t decimals = 3;
+
+    //if(state == STATE_ESTOP)
+    //    return;
+
+    if(keycode) {
+
+        if(keypad.on_keypress_preview && keypad.on_keypress_preview(keycode, state))
+            return false;
 
         switch(keycode) {
 
@@ -558,9 +1724,9 @@ static void keypad_process_keypress (sys_state_t state)
                 break;
              case MACROHOME:                                   // change WCS                
                 if (gc_state.modal.coord_system.id  < N_WorkCoordinateSystems-1)
-                    strcat(strcpy(command, "G"), map_coord_system(gc_state.modal.coord_system.id+1));    
+                    map_coord_system(strcpy(command, "G") + 1, gc_state.modal.coord_system.id+1);
                 else
-                    strcat(strcpy(command, "G"), map_coord_system(0x00));
+                    map_coord_system(strcpy(command, "G") + 1, 0x00);
                 break;                
                 break;
              case UNLOCK:  
@@ -728,47 +1894,423 @@ static void keypad_process_keypress (sys_state_t state)
 
         if(command[0] != '\0') {
             // add distance and speed to jog commands
-            switch(jogModify){
-                case JogModify_1:
-                    jog_modifier = 1;
-                break;
-                case JogModify_01:
-                    jog_modifier = 0.1;                    
-                break;
-                case JogModify_001:
-                    jog_modifier = 0.01;                    
-                break;                                                            
-            }
+            jog_modifier = jog_modify_factor[jogModify];
             if((jogCommand = (command[0] == '$' && command[1] == 'J'))) switch(jogMode) {
                 case JogMode_Slow:
-                    strrepl(command, '?', ftoa(jog.slow_distance, 0));
+                    distance = jog.slow_distance;
                     strcat(command, ftoa(jog.slow_speed*jog_modifier, 0));
                     break;
 
                 case JogMode_Step:
-                    strrepl(command, '?', ftoa(jog.step_distance*jog_modifier, gc_state.modal.units_imperial ? 4 : 3));
+                    distance = jog.step_distance * jog_modifier * count;
+                    decimals = gc_state.modal.units_imperial ? 4 : 3;
                     strcat(command, ftoa(jog.step_speed, 0));
                     break;
 
                 default:
-                    strrepl(command, '?', ftoa(jog.fast_distance, 0));
+                    distance = jog.fast_distance;
                     strcat(command, ftoa(jog.fast_speed*jog_modifier, 0));
                     break;
             }
-            if(!(jogCommand && keyreleased)) { // key still pressed? - do not execute jog command if released!             
-                addedGcode = grbl.enqueue_gcode((char *)command);
-                jogging = jogging || (jogCommand && addedGcode);
+            if(!jogCommand)
+                grbl.enqueue_gcode(command);
+            else if(distance != 0.0f) // do not execute jog command if released, distance is clipped when handed to the core.
+                jog_submit(command, jog_keycode_bits(keycode), distance, decimals, gen);
+        }
+    }
+
+    return keycode != '\0';
+}
+
+// Returns the override change in percent of a feed or spindle override delta keycode, 0 if none.
+// spindle is set to true for spindle overrides.
+static int_fast8_t override_delta (char keycode, bool *spindle)
+{
+    *spindle = false;
+
+    switch(keycode) {
+
+        case CMD_OVERRIDE_SPINDLE_COARSE_PLUS:
+            *spindle = true;
+            // no break
+        case CMD_OVERRIDE_FEED_COARSE_PLUS:
+            return OVERRIDE_COARSE_STEP;
+
+        case CMD_OVERRIDE_SPINDLE_COARSE_MINUS:
+            *spindle = true;
+            // no break
+        case CMD_OVERRIDE_FEED_COARSE_MINUS:
+            return -OVERRIDE_COARSE_STEP;
+
+        case CMD_OVERRIDE_SPINDLE_FINE_PLUS:
+            *spindle = true;
+            // no break
+        case CMD_OVERRIDE_FEED_FINE_PLUS:
+            return 1;
+
+        case CMD_OVERRIDE_SPINDLE_FINE_MINUS:
+            *spindle = true;
+            // no break
+        case CMD_OVERRIDE_FEED_FINE_MINUS:
+            return -1;
+    }
+
+    return 0;
+}
+
+// Merges queued feed or spindle override delta keycodes following keycode in the same direction
+// into their sum and enqueues the fewest coarse and fine override commands for it. Changes in opposite
+// directions are not merged as the result would differ near the override limits. keycode is updated
+// to the last keycode merged. Returns false if there was nothing to merge.
+static bool keypad_merge_overrides (char *keycode)
+{
+    bool spindle, next_spindle;
+    int_fast16_t delta = override_delta(*keycode, &spindle), next;
+    uint_fast16_t steps, count;
+
+    if(delta == 0 || (next = override_delta(keypad_peek_keycode(), &next_spindle)) == 0 || next_spindle != spindle || (next > 0) != (delta > 0))
+        return false;
+
+    do {
+        delta += next;
+        *keycode = keypad_get_keycode();
+    } while((next = override_delta(keypad_peek_keycode(), &next_spindle)) && next_spindle == spindle && (next > 0) == (delta > 0));
+
+    steps = delta < 0 ? -delta : delta;
+
+    for(count = steps / OVERRIDE_COARSE_STEP; count; count--) {
+        if(spindle)
+            enqueue_spindle_override(delta > 0 ? CMD_OVERRIDE_SPINDLE_COARSE_PLUS : CMD_OVERRIDE_SPINDLE_COARSE_MINUS);
+        else
+            enqueue_feed_override(delta > 0 ? CMD_OVERRIDE_FEED_COARSE_PLUS : CMD_OVERRIDE_FEED_COARSE_MINUS);
+    }
+
+    for(count = steps % OVERRIDE_COARSE_STEP; count; count--) {
+        if(spindle)
+            enqueue_spindle_override(delta > 0 ? CMD_OVERRIDE_SPINDLE_FINE_PLUS : CMD_OVERRIDE_SPINDLE_FINE_MINUS);
+        else
+            enqueue_feed_override(delta > 0 ? CMD_OVERRIDE_FEED_FINE_PLUS : CMD_OVERRIDE_FEED_FINE_MINUS);
+    }
+
+    send_status_info();
+
+    return true;
+}
+
+static void keypad_process_keypress (sys_state_t state)
+{
+    bool processed;
+    uint_fast8_t count = 1;
+    uint_fast16_t gen = jog_release_gen;
+    char keycode = keypad_get_keycode();
+
+    PERF_BEGIN();
+
+    if(keypad.on_keypress_preview == NULL && keypad_merge_overrides(&keycode))
+        processed = true;
+    else {
+        // Merge queued presses of the same step jog key into a single jog.
+        if(keypad.on_keypress_preview == NULL && jogMode == JogMode_Step && jog_keycode_bits(keycode)) {
+            while(count < 255 && keypad_peek_keycode() == keycode) {
+                keypad_get_keycode();
+                count++;
             }
         }
+        processed = keypad_process_keycode(keycode, state, gen, count);
+    }
+
+    PERF_END(keycode >= CMD_OVERRIDE_FEED_RESET && keycode <= CMD_OVERRIDE_COOLANT_MIST_TOGGLE
+              ? Perf_KeypressOverride
+              : (keycode && strchr("RLFBUDrqstwvux", keycode) ? Perf_KeypressJog : Perf_KeypressOther));
+
+    // Arm auto-repeat if the key is still held, the pendant sends the keycode only once.
+    if(processed && !jog_released(gen) && keypad_is_repeatable(keycode)) {
+        keyrepeat.interval = KEYPAD_REPEAT_RATE;
+        keyrepeat.next = hal.get_elapsed_ticks() + KEYPAD_REPEAT_DELAY;
+        keyrepeat.gen = gen;
+        keyrepeat.keycode = keycode;
+        if(jog_released(gen))   // Released while arming, the handler may have cleared the keycode before it was set.
+            keyrepeat.keycode = '\0';
+        else
+            task_schedule(Task_Repeat, keyrepeat.next);
     }
 }
 
+// Generates repeats for a held key from the tick counter so that the cadence
+// does not depend on the bus. Repeat deadlines advance from the previous deadline,
+// a step jog repeat is held back until the previous step has completed.
+static void keypad_repeat (uint32_t ms)
+{
+    char keycode = keyrepeat.keycode;
+
+    if(keycode == '\0')
+        return;
+
+    if(jog_released(keyrepeat.gen) || !keypad_is_repeatable(keycode)) {
+        keyrepeat.keycode = '\0';
+        return;
+    }
+
+    if(jog_busy()) {
+        task_schedule(Task_Repeat, ms + REPEAT_RETRY_DELAY);
+        return;
+    }
+
+    keyrepeat.next += keyrepeat.interval;
+    if((int32_t)(ms - keyrepeat.next) >= 0)  // Fell behind, do not burst.
+        keyrepeat.next = ms + keyrepeat.interval;
+
+    if((keyrepeat.interval = keyrepeat.interval * KEYPAD_REPEAT_ACCEL / 100) < KEYPAD_REPEAT_MIN)
+        keyrepeat.interval = KEYPAD_REPEAT_MIN;
+
+    task_schedule(Task_Repeat, keyrepeat.next);
+
+    keypad_process_keycode(keycode, state_get(), keyrepeat.gen, 1);
+}
+
+#if KEYPAD_PERF
+
+static const char jog_keycodes[] = {
+    JOG_XR, JOG_XL, JOG_YF, JOG_YB, JOG_ZU, JOG_ZD,
+    JOG_XRYF, JOG_XRYB, JOG_XLYF, JOG_XLYB, JOG_XRZU, JOG_XRZD, JOG_XLZU, JOG_XLZD,
+#if N_AXIS > 3
+    MACRORAISE, MACROLOWER
+#endif
+};
+
+#define N_PERF_BENCH (Perf_Keypress_0 + sizeof(jog_keycodes))
+
+// Reference timings in ns per call, 0 if not recorded. No baselines are shipped as they
+// depend on the target and compiler, define KEYPAD_PERF_BASELINES as a comma separated list
+// in perf_id_t order with values from a reference run on the target to enable regression checks.
+static const uint32_t perf_baseline_ns[N_PERF_BENCH] = {
+#ifdef KEYPAD_PERF_BASELINES
+    KEYPAD_PERF_BASELINES
+#endif
+};
+
+static const char *perf_name (uint_fast8_t id)
+{
+    static const char *names[] = {
+        "status_send", "keypress_jog", "keypress_override", "keypress_other",
+        "keypad_enqueue_keycode", "i2c_enqueue_keycode",
+        "status_assemble", "jog_string", "get_macro_char",
+        "keypad_enqueue_keycode_batch", "i2c_enqueue_keycode_batch"
+    };
+    static char name[] = "keypress_0x00";
+
+    if(id < Perf_Keypress_0)
+        return names[id];
+
+    name[11] = "0123456789ABCDEF"[(jog_keycodes[id - Perf_Keypress_0] >> 4) & 0x0F];
+    name[12] = "0123456789ABCDEF"[jog_keycodes[id - Perf_Keypress_0] & 0x0F];
+
+    return name;
+}
+
+// Outputs one result line, total and max are in perf_now() units:
+// [KPPERF:<name>|<calls>|<ns/call>|<cycles/call>|<max us>|<baseline ns>|<threshold %>|<OK, REGRESSION or NOBASE>]
+// cycles/call is 0 when there is no cycle counter.
+static void perf_report (uint_fast8_t id, uint32_t calls, uint64_t total, uint32_t max)
+{
+#if PERF_CYCLES
+    uint32_t cycles = calls ? (uint32_t)(total / calls) : 0;
+    uint32_t ns = calls && hal.f_mcu ? (uint32_t)(total * 1000ULL / hal.f_mcu / calls) : 0;
+    uint32_t max_us = hal.f_mcu ? max / hal.f_mcu : 0;
+#else
+    uint32_t cycles = 0;
+    uint32_t ns = calls ? (uint32_t)(total * 1000ULL / calls) : 0;
+    uint32_t max_us = max;
+#endif
+    uint32_t baseline = id < N_PERF_BENCH ? perf_baseline_ns[id] : 0;
+
+    hal.stream.write("[KPPERF:");
+    hal.stream.write(perf_name(id));
+    hal.stream.write("|");
+    hal.stream.write(uitoa(calls));
+    hal.stream.write("|");
+    hal.stream.write(uitoa(ns));
+    hal.stream.write("|");
+    hal.stream.write(uitoa(cycles));
+    hal.stream.write("|");
+    hal.stream.write(uitoa(max_us));
+    hal.stream.write("|");
+    hal.stream.write(uitoa(baseline));
+    hal.stream.write("|");
+    hal.stream.write(uitoa(KEYPAD_PERF_THRESHOLD));
+    hal.stream.write(baseline == 0 || calls == 0 ? "|NOBASE]" : (ns > baseline + baseline * KEYPAD_PERF_THRESHOLD / 100 ? "|REGRESSION]" : "|OK]"));
+    hal.stream.write(ASCII_EOL);
+}
+
+static status_code_t perf_run (sys_state_t state, char *args)
+{
+    static const char macro[] = "G0X10Y10|G1X20F100|G2X30Y20I5J0|G1Z-1|G0Z5|G53G0Z0|G4P0|"
+                                "G10L20P1X0Y0|G0X0Y0|G1X1|G1X2|G1X3|G1X4|G1X5|G1X6|G1X7|G1X8|G1X9|G0Z10|"; // 127 characters
+    uint_fast8_t idx;
+    uint_fast16_t n;
+    uint32_t t0, total;
+    nvs_address_t address;
+    char cmd[35];
+    status_snapshot_t snap;
+    Machine_status_packet packet;
+    bool released = keyreleased;
+
+    if(!(state == STATE_IDLE && !is_executing))
+        return Status_IdleError;
+
+    perf_batch = true;
+
+    t0 = perf_now();
+    for(n = 0; n < KEYPAD_PERF_ITERATIONS; n++) {
+        status_snapshot_take(&snap, 0);
+        status_pack(&packet, &snap);
+    }
+    perf_report(Perf_StatusAssemble, KEYPAD_PERF_ITERATIONS, perf_now() - t0, 0);
+
+    t0 = perf_now();
+    for(n = 0; n < KEYPAD_PERF_ITERATIONS; n++) {
+        jog_command(cmd, "X-?Y-?F");
+        strrepl(cmd, '?', ftoa(jog.step_distance, 3));
+        strcat(cmd, ftoa(jog.step_speed, 0));
+    }
+    perf_report(Perf_JogString, KEYPAD_PERF_ITERATIONS, perf_now() - t0, 0);
+
+    total = 0;
+    for(n = 0; n < KEYPAD_PERF_ITERATIONS; n++) {
+        command = (char *)macro;
+        macro_stream.source = MacroSource_String;
+        mux.macro_end = false;
+        t0 = perf_now();
+        while(get_macro_char() != SERIAL_NO_DATA);
+        total += perf_now() - t0;
+    }
+    perf_report(Perf_MacroChar, KEYPAD_PERF_ITERATIONS * (sizeof(macro) + 1), total, 0);
+
+    // Keycode enqueue paths, run with keypress processing disabled and the buffer flushed after each call.
+    address = keypad_nvs_address;
+    keypad_nvs_address = 0;
+
+    t0 = perf_now();
+    for(n = 0; n < KEYPAD_PERF_ITERATIONS; n++) {
+        keypad_enqueue_keycode('0');
+        keybuf.tail = keybuf.head;
+    }
+    perf_report(Perf_KeypadEnqueueBatch, KEYPAD_PERF_ITERATIONS, perf_now() - t0, 0);
+
+#if KEYPAD_ENABLE == 1
+    t0 = perf_now();
+    for(n = 0; n < KEYPAD_PERF_ITERATIONS; n++) {
+        i2c_enqueue_keycode('0');
+        keybuf.tail = keybuf.head;
+    }
+    perf_report(Perf_I2CEnqueueBatch, KEYPAD_PERF_ITERATIONS, perf_now() - t0, 0);
+#endif
+
+    keypad_nvs_address = address;
+
+    // Jog keypresses only queue the jog command, it is discarded when done.
+    keyreleased = false;
+
+    for(idx = 0; idx < sizeof(jog_keycodes); idx++) {
+        t0 = perf_now();
+        for(n = 0; n < KEYPAD_PERF_ITERATIONS; n++)
+            keypad_process_keycode(jog_keycodes[idx], state, jog_release_gen, 1);
+        perf_report(Perf_Keypress_0 + idx, KEYPAD_PERF_ITERATIONS, perf_now() - t0, 0);
+    }
+
+    keyreleased = released;
+    *jog_pending.line = '\0';
+
+    perf_batch = false;
+
+    for(idx = 0; idx < Perf_StatusAssemble; idx++)
+        perf_report(idx, perf_counters[idx].calls, perf_counters[idx].total, perf_counters[idx].max);
+
+    return Status_OK;
+}
+
+#endif
+
+// Outputs the status frame link counters.
+static status_code_t link_stats (sys_state_t state, char *args)
+{
+    char buf[60];
+
+    sprintf(buf, "[KPLINK:%lu|%lu|%lu|%lu]" ASCII_EOL, (unsigned long)pendant_link.sent, (unsigned long)pendant_link.failed,
+                                                      (unsigned long)pendant_link.retried, (unsigned long)pendant_link.nak);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+static const sys_command_t keypad_command_list[] = {
+    {"KPLINK", link_stats, { .noargs = On }},
+#if KEYPAD_PERF
+    {"KPPERF", perf_run, { .noargs = On }}
+#endif
+};
+
+static sys_commands_t keypad_commands = {
+    .n_commands = sizeof(keypad_command_list) / sizeof(sys_command_t),
+    .commands = keypad_command_list
+};
+
+static sys_commands_t *keypad_get_commands (void)
+{
+    return &keypad_commands;
+}
+
+// Passes messages from the core on to the pendant.
+static void onGcodeMessage (char *msg)
+{
+    message_enqueue(msg, Message_Plain);
+
+    if(on_gcode_message)
+        on_gcode_message(msg);
+}
+
+static status_code_t onStatusMessage (status_code_t status_code)
+{
+    if(status_code != Status_OK) {
+        char msg[12];
+        sprintf(msg, "error:%d", (uint8_t)status_code);
+        message_enqueue(msg, Message_Warning);
+    }
+
+    return status_message(status_code);
+}
+
+// Forwards feedback messages from the core, e.g. "Caution: Unlocked" or "Check Door", to the pendant.
+static message_code_t onFeedbackMessage (message_code_t message_code)
+{
+    const message_t *msg;
+
+    if(message_code != Message_None && (msg = message_get(message_code)) && msg->text)
+        message_enqueue(msg->text, msg->type);
+
+    return feedback_message(message_code);
+}
+
+// The report handlers are reset to their defaults on every soft reset, hook
+// the status and feedback message handlers again each time they have been set up.
+static void onReportHandlersInit (void)
+{
+    if(on_report_handlers_init)
+        on_report_handlers_init();
+
+    status_message = grbl.report.status_message;
+    grbl.report.status_message = onStatusMessage;
+
+    feedback_message = grbl.report.feedback_message;
+    grbl.report.feedback_message = onFeedbackMessage;
+}
+
 static void onReportOptions (bool newopt)
 {
     on_report_options(newopt);
 
     if(!newopt){
-        hal.stream.write("[PLUGIN:KEYPAD v1.4 Jog2K]"  ASCII_EOL);
+        hal.stream.write("[PLUGIN:KEYPAD v1.5 Jog2K]"  ASCII_EOL);
         hal.stream.write("[PLUGIN:Macro plugin v0.02]" ASCII_EOL);
     }
 }
@@ -777,27 +2319,38 @@ ISR_CODE bool ISR_FUNC(keypad_enqueue_keycode)(char c)
 {
     uint32_t bptr = (keybuf.head + 1) & (KEYBUF_SIZE - 1);    // Get next head pointer
 
+    if(jog_vector_collect(c))
+        return true;
+
+    if(c == KEYPAD_NAK) {
+        pendant_link.nak++;
+        pendant_link.resend = true;
+        return true;
+    }
+
 #if MPG_MODE != 2
     if(c == CMD_MPG_MODE_TOGGLE)
         return true;
 #endif
 
+    PERF_BEGIN();
+
     if(c == CMD_JOG_CANCEL || c == ASCII_CAN) {
-        keyreleased = true;
-        if(jogging) {
-            jogging = false;
-            grbl.enqueue_realtime_command(CMD_JOG_CANCEL);
-        }
+        jog_release();
         keybuf.tail = keybuf.head;      // Flush keycode buffer.
     } else if(bptr != keybuf.tail) {    // If not buffer full
         keybuf.buf[keybuf.head] = c;    // add data to buffer
         keybuf.head = bptr;             // and update pointer.
         keyreleased = false;
+#if !KEYPAD_IO_TASK
         // Tell foreground process to process keycode
         if(keypad_nvs_address != 0)
             protocol_enqueue_rt_command(keypad_process_keypress);
+#endif
     }
 
+    PERF_END(Perf_KeypadEnqueue);
+
     return true;
 }
 
@@ -807,83 +2360,423 @@ ISR_CODE static void ISR_FUNC(i2c_enqueue_keycode)(char c)
 {
     uint32_t bptr = (keybuf.head + 1) & (KEYBUF_SIZE - 1);    // Get next head pointer
 
-    //if the keycode is an unlock or reset command, execute them  immediately as the command queue is not processed while in estop.
+    pendant_link.last_rx = hal.get_elapsed_ticks();
+    pendant_link.strobe_read = false;
+
+    // Nothing to read, e.g. the keycode of this strobe cycle was taken by a keepalive read.
+    if(c == '\0')
+        return;
+
+    //if the keycode is an unlock or reset command, execute them immediately as the command queue is not processed while in estop.
+    //checked first so that they are never taken for a key state bitmap byte.
     switch (c){
         case UNLOCK:
-            grbl.enqueue_realtime_command(CMD_STOP);
+            keypad_rt_command(CMD_STOP);
         break;   
         case RESET:
-            grbl.enqueue_realtime_command(CMD_RESET);
+            keypad_rt_command(CMD_RESET);
         break;
-        case 'H':
-            protocol_enqueue_rt_command(run_homing);
-        break;                          
-    }    
+    }
+
+    if((jog_vector.strobe = jog_vector_collect(c)))
+        return;
+
+    PERF_BEGIN();
+
+    if(c == 'H')
+        keypad_rt_command('H');
        
     if(bptr != keybuf.tail) {           // If not buffer full
         keybuf.buf[keybuf.head] = c;    // add data to buffer
         keybuf.head = bptr;             // and update pointer
+#if !KEYPAD_IO_TASK
         // Tell foreground process to process keycode
         if(keypad_nvs_address != 0)
             protocol_enqueue_rt_command(keypad_process_keypress);
+#endif
     }
+
+    PERF_END(Perf_I2CEnqueue);
 }
 
 ISR_CODE bool ISR_FUNC(keypad_strobe_handler)(uint_fast8_t id, bool keydown)
 {
-    keyreleased = !keydown;
-
     if(keydown){
+        keyreleased = false;
+        keyrepeat.keycode = '\0';
+        pendant_link.strobe_time = hal.get_elapsed_ticks();
+        pendant_link.strobe_read = true;
+#if KEYPAD_IO_TASK
+        pendant_link.strobe_request = true;    // The bus is only used from the I/O core, keypad_io_task() starts the read.
+#else
         i2c_get_keycode(KEYPAD_I2CADDR, i2c_enqueue_keycode);
+#endif
     }
-
-    else if(jogging) {
-        jogging = false;
-        grbl.enqueue_realtime_command(CMD_JOG_CANCEL);
-        keybuf.tail = keybuf.head; // flush keycode buffer
-    }
-    else {
+    else if(!jog_vector.strobe) {   // Bitmap jogs are stopped by an all zero bitmap.
+        jog_release();
         keybuf.tail = keybuf.head; // flush keycode buffer
     }
 
     return true;
 }
 
+// Tracks the jog lifecycle, a jog handed to the core becomes Active when it enters
+// STATE_JOG and a deferred cancel is sent then. Leaving STATE_JOG ends the jog.
 static void onStateChanged (sys_state_t state)
 {
+    if(state == STATE_JOG) {
+        if(jog_pending.awaiting) {
+            jog_pending.awaiting = false;
+            if(shared_xchg(&jog_state, JogState_Active) == JogState_Cancelling) {
+                shared_xchg(&jog_state, JogState_Cancelling);
+                grbl.enqueue_realtime_command(CMD_JOG_CANCEL);  // Released before the jog started.
+            } else {    // Start heartbeat monitoring at the jog rate.
+                pendant_link.jog_start = hal.get_elapsed_ticks();
+                task_request(Task_Link);
+                task_request(Task_Keepalive);
+            }
+        }
+    } else if(!jog_pending.awaiting && jog_state != JogState_Idle && jog_state != JogState_Requested)
+        shared_xchg(&jog_state, JogState_Idle);
+
     send_status_info();
     if (on_state_change)         // Call previous function in the chain.
         on_state_change(state);    
 }
 
-static void keypad_poll (void)
+// Sends status periodically, more often during manual jogging.
+static void keypad_status_task (uint32_t ms)
 {
-    static uint32_t last_ms;
+    send_status_info();
 
-    uint32_t ms = hal.get_elapsed_ticks();
+    task_schedule(Task_Status, ms + (state_get() == STATE_JOG ? SEND_STATUS_JOG_DELAY : SEND_STATUS_DELAY));
+}
 
-    //check more often during manual jogging
-    if (state_get() == STATE_JOG){
-        if(ms < last_ms + SEND_STATUS_JOG_DELAY)
-            return;
-        
-        send_status_info();
-        last_ms = ms;
+// Runs status assembly stages, more than one per pass only if the worst case time
+// seen for the next stage fits in what is left of the KEYPAD_STATUS_BUDGET us budget.
+// Without a microsecond timer, or until a stage has been timed, one stage is run per pass.
+static void keypad_status_build_task (uint32_t ms)
+{
+    static volatile uint_fast16_t busy = 0;
+    status_stage_t stage;
+    uint32_t t0, t, now;
 
-    } else{
-        if(ms < last_ms + SEND_STATUS_DELAY) // check once every update period
+    if(hal.set_value_atomic(&busy, 1)) { // Nested call from a delay while the bus is busy.
+        task_schedule(Task_StatusBuild, ms);
         return;
-        
+    }
+
+    PERF_BEGIN();
+
+    t0 = t = hal.get_micros ? hal.get_micros() : 0;
+
+    do {
+        switch((stage = status_build.stage)) {
+
+            case StatusStage_Motion:
+                status_take_motion(&status_build.snap, status_build.steps, ms);
+                break;
+
+            case StatusStage_Position:
+                status_take_position(&status_build.snap, status_build.steps);
+                break;
+
+            case StatusStage_Machine:
+                status_take_machine(&status_build.snap);
+                break;
+
+            case StatusStage_Spindle:
+                status_take_spindle(&status_build.snap);
+                break;
+
+            case StatusStage_Send:
+                status_publish(&status_build.snap);
+                status_build.last_ms = ms;
+                break;
+
+            default:
+                break;
+        }
+
+        status_build.stage = stage == StatusStage_Send ? StatusStage_Idle : stage + 1;
+
+        if(hal.get_micros) {
+            now = hal.get_micros();
+            if(now - t > status_build.cost[stage])
+                status_build.cost[stage] = now - t;
+            status_build.measured |= bit(stage);
+            t = now;
+        }
+    } while(hal.get_micros && status_build.stage != StatusStage_Idle && (status_build.measured & bit(status_build.stage)) &&
+             t - t0 + status_build.cost[status_build.stage] <= KEYPAD_STATUS_BUDGET);
+
+    if(status_build.stage != StatusStage_Idle)
+        task_schedule(Task_StatusBuild, ms);
+    else if(status_build.pending) {
+        status_build.pending = false;
         send_status_info();
-        last_ms = ms;
+    }
+
+    PERF_END(Perf_StatusSend);
+
+    busy = 0;
+}
+
+// Sends the next page of the oldest queued message when the bus is idle: no status frame is being
+// assembled or due and no keycode has been received within KEYPAD_MSG_PAGE_DELAY ms.
+static void keypad_message_task (uint32_t ms)
+{
+    size_t len, offset;
+    keypad_msg_t *msg;
+
+    if(msgqueue.tail == msgqueue.head)
+        return;
+
+    if(pendant_link.disconnected) {
+        task_schedule(Task_Message, ms + SEND_STATUS_DELAY);
+        return;
+    }
+
+    if(status_busy(ms) || ms - pendant_link.last_rx < KEYPAD_MSG_PAGE_DELAY) {
+        task_schedule(Task_Message, ms + MESSAGE_RETRY_DELAY);
+        return;
+    }
+
+    msg = &msgqueue.msg[msgqueue.tail];
+    len = strlen(msg->text);
+    offset = msgqueue.page * KEYPAD_MSG_PAGE_SIZE;
+
+    message_packet.address = 0x02;
+    message_packet.type = (uint8_t)msg->type;
+    message_packet.id = msgqueue.id;
+    message_packet.page = msgqueue.page;
+    message_packet.pages = len ? (len + KEYPAD_MSG_PAGE_SIZE - 1) / KEYPAD_MSG_PAGE_SIZE : 1;
+    memset(message_packet.text, 0, KEYPAD_MSG_PAGE_SIZE);
+    if(offset < len)
+        memcpy(message_packet.text, msg->text + offset, min(len - offset, KEYPAD_MSG_PAGE_SIZE));
+
+    if(i2c_send(KEYPAD_I2CADDR, (uint8_t *)&message_packet, sizeof(Machine_message_packet), 0)) {
+        if(++msgqueue.page == message_packet.pages) {
+            msgqueue.page = 0;
+            msgqueue.id++;
+            msgqueue.tail = (msgqueue.tail + 1) & (KEYPAD_MSG_QUEUE - 1);
+        }
+    }
+
+    if(msgqueue.tail != msgqueue.head)
+        task_schedule(Task_Message, ms + KEYPAD_MSG_PAGE_DELAY);
+}
+
+// Samples the actual spindle RPM into the cache read by status frame assembly, only while the spindle
+// is on. get_data() returns the data kept by the spindle driver, e.g. polled from a VFD in the background,
+// the spindle state is not read from the driver. Held back while a status frame is being assembled.
+static void keypad_spindle_task (uint32_t ms)
+{
+    spindle_ptrs_t *spindle;
+
+    if(status_build.stage != StatusStage_Idle) {
+        task_schedule(Task_Spindle, ms + SPINDLE_RETRY_DELAY);
+        return;
+    }
+
+    spindle = spindle_get(0);
+
+    if(spindle->param->state.on && spindle->cap.variable && spindle->get_data) {
+        spindle_cache.rpm = spindle->get_data(SpindleData_RPM)->rpm;
+        spindle_cache.timestamp = ms;
+    }
+
+    task_schedule(Task_Spindle, ms + KEYPAD_SPINDLE_RATE);
+}
+
+// Called from interrupt context with the reply to a keepalive read, the callback
+// is not called if the pendant does not acknowledge its address. A KEYPAD_NAK reply
+// requests the last status frame again, it needs no strobe cycle.
+ISR_CODE static void ISR_FUNC(keypad_keepalive)(char c)
+{
+    pendant_link.last_rx = hal.get_elapsed_ticks();
+
+    if(c == KEYPAD_NAK) {
+        pendant_link.nak++;
+        pendant_link.resend = true;
+    } else if(c != '\0')   // Keycode of a strobe cycle read before the strobe read got it.
+        i2c_enqueue_keycode(c);
+}
+
+// Polls the pendant with a keepalive read every KEYPAD_LINK_TIMEOUT / 4 ms while
+// jogging and every SEND_STATUS_DELAY ms else. A non-blocking send only tells
+// that the transfer was started so sends do not count as responses.
+static void keypad_keepalive_task (uint32_t ms)
+{
+    bool jogging = jog_state == JogState_Active;
+
+    // A keepalive read would take the keycode of a strobe cycle, hold it back while the strobe read is outstanding.
+    // The wait is limited as the read callback is not called if the pendant does not acknowledge the read.
+    if(pendant_link.strobe_read && ms - pendant_link.strobe_time < STROBE_READ_TIMEOUT) {
+        task_schedule(Task_Keepalive, ms + KEEPALIVE_RETRY_DELAY);
+        return;
+    }
+
+    i2c_get_keycode(KEYPAD_I2CADDR, keypad_keepalive);
+
+    task_schedule(Task_Keepalive, ms + (jogging ? KEYPAD_LINK_TIMEOUT / 4 : SEND_STATUS_DELAY));
+}
+
+// Checks the pendant heartbeat, cancels an active jog if the pendant has
+// not responded within KEYPAD_LINK_TIMEOUT.
+static void keypad_link_task (uint32_t ms)
+{
+    bool jogging = jog_state == JogState_Active;
+    uint32_t last = pendant_link.last_rx;
+
+    if(jogging && (int32_t)(pendant_link.jog_start - last) > 0)
+        last = pendant_link.jog_start;
+
+    if(ms - last > (jogging ? KEYPAD_LINK_TIMEOUT : KEYPAD_LINK_TIMEOUT + 2 * SEND_STATUS_DELAY)) {
+        if(!pendant_link.disconnected) {
+            pendant_link.disconnected = true;
+            keypad_report_message("Keypad link lost", Message_Warning);
+        }
+        if(jogging) {
+            jog_stop();
+            keypad_report_message("Keypad link lost, jog cancelled", Message_Warning);
+        }
+    } else if(pendant_link.disconnected) {
+        pendant_link.disconnected = false;
+        keypad_report_message("Keypad link restored", Message_Info);
+    }
+
+    task_schedule(Task_Link, ms + (jogging ? KEYPAD_LINK_TIMEOUT / 4 : SEND_STATUS_DELAY));
+}
+
+static const keypad_task_ptr task_fns[Task_N] = {
+    [Task_Repeat] = keypad_repeat,
+    [Task_JogVector] = keypad_jog_vector_task,
+    [Task_Link] = keypad_link_task,
+    [Task_Spindle] = keypad_spindle_task,
+    [Task_Status] = keypad_status_task,
+    [Task_StatusBuild] = keypad_status_build_task,
+    [Task_Keepalive] = keypad_keepalive_task,
+    [Task_Message] = keypad_message_task
+};
+
+// Runs due tasks of a context in task id order, returns after one tick counter comparison if none is due.
+static void tasks_run (uint_fast8_t context, uint32_t ms)
+{
+    uint_fast8_t idx;
+
+#if KEYPAD_IO_TASK
+    for(idx = 0; idx < Task_N; idx++) {
+        if(TASK_CONTEXT(idx) == context && task_requests[idx] && shared_xchg(&task_requests[idx], false))
+            task_schedule((keypad_task_id_t)idx, ms);
+    }
+#endif
+
+    if((int32_t)(ms - next_deadline[context]) < 0)
+        return;
+
+    next_deadline[context] = ms + SEND_STATUS_DELAY;
+
+    for(idx = 0; idx < Task_N; idx++) {
+        if(TASK_CONTEXT(idx) == context && tasks[idx].active && (int32_t)(ms - tasks[idx].deadline) >= 0) {
+            tasks[idx].active = false;
+            task_fns[idx](ms);
+        }
+    }
+
+    for(idx = 0; idx < Task_N; idx++) {
+        if(TASK_CONTEXT(idx) == context && tasks[idx].active && (int32_t)(tasks[idx].deadline - next_deadline[context]) < 0)
+            next_deadline[context] = tasks[idx].deadline;
     }
 }
 
+#if KEYPAD_IO_TASK
+
+// Performs realtime commands queued by the keypad interrupt handlers.
+static void action_dispatch (void)
+{
+    char cmd;
+
+    while(actionq.tail != actionq.head) {
+
+        __sync_synchronize();
+        cmd = actionq.cmd[actionq.tail];
+        actionq.tail = (actionq.tail + 1) & (KEYPAD_ACTION_QUEUE - 1);
+
+        if(cmd == 'H')
+            run_homing(state_get());
+        else
+            grbl.enqueue_realtime_command(cmd);
+    }
+}
+
+#endif
+
+// Runs the protocol loop side of the plugin. With the I/O task enabled keycodes and key state
+// bitmaps received by the interrupt handlers are processed here, pendant I/O is left to keypad_io_task().
+static inline void keypad_poll (void)
+{
+    uint32_t ms = hal.get_elapsed_ticks();
+
+#if KEYPAD_IO_TASK
+    action_dispatch();
+
+    if(jog_vector.changed && shared_xchg(&jog_vector.changed, false))
+        keypad_process_jog_vector(state_get());
+
+    while(keybuf.tail != keybuf.head)
+        keypad_process_keypress(state_get());
+#else
+    if(status_build.stage == StatusStage_Idle)
+        status_resend();
+    else    // A new status frame is being assembled.
+        pendant_link.resend = pendant_link.retry = false;
+#endif
+
+    tasks_run(0, ms);
+}
+
+#if KEYPAD_IO_TASK
+
+// Runs one pass of pendant I/O, to be called repeatedly from the I/O task or second core.
+// All I2C transactions are started from here, including the keycode reads requested by the strobe interrupt.
+// Only status frames built from snapshots taken by the protocol loop are sent,
+// core functions are not called from here.
+void keypad_io_task (void)
+{
+    uint_fast8_t head;
+    uint32_t ms;
+
+    if(keypad_nvs_address == 0)
+        return;
+
+    ms = hal.get_elapsed_ticks();
+
+    if(pendant_link.strobe_request && shared_xchg(&pendant_link.strobe_request, false))
+        i2c_get_keycode(KEYPAD_I2CADDR, i2c_enqueue_keycode);
+
+    // Send the newest queued snapshot, older ones are skipped.
+    if((head = snapq.head) != snapq.tail) {
+        __sync_synchronize();
+        status_send(&snapq.snap[(head - 1) & (KEYPAD_SNAPSHOT_QUEUE - 1)]);
+        __sync_synchronize();   // Snapshot must be consumed before the slots are released.
+        snapq.tail = head;
+    }
+
+    status_resend();
+
+    tasks_run(1, ms);
+}
+
+#endif
+
 static void keypad_poll_realtime (sys_state_t grbl_state)
 {
     on_execute_realtime(grbl_state);
 
     keypad_poll();
+
+    jog_dispatch();
 }
 
 static void keypad_poll_delay (sys_state_t grbl_state)
@@ -891,6 +2784,8 @@ static void keypad_poll_delay (sys_state_t grbl_state)
     on_execute_delay(grbl_state);
 
     keypad_poll();
+
+    jog_dispatch();
 }
 
 static void jogmode_changed (jogmode_t jogMode)
@@ -924,6 +2819,21 @@ bool keypad_init (void)
         on_report_options = grbl.on_report_options;
         grbl.on_report_options = onReportOptions;
 
+        on_gcode_message = grbl.on_gcode_message;
+        grbl.on_gcode_message = onGcodeMessage;
+
+        on_report_handlers_init = grbl.on_report_handlers_init;
+        grbl.on_report_handlers_init = onReportHandlersInit;
+
+#if KEYPAD_PERF
+        perf_init();
+#endif
+
+        task_schedule(Task_Spindle, hal.get_elapsed_ticks());
+        task_schedule(Task_Status, hal.get_elapsed_ticks());
+        task_schedule(Task_Link, hal.get_elapsed_ticks() + SEND_STATUS_DELAY);
+        task_schedule(Task_Keepalive, hal.get_elapsed_ticks());
+
         on_execute_realtime = grbl.on_execute_realtime;
         grbl.on_execute_realtime = keypad_poll_realtime;
 
@@ -944,6 +2854,9 @@ bool keypad_init (void)
 
         on_state_change = grbl.on_state_change;             // Subscribe to the state changed event by saving away the original
         grbl.on_state_change = onStateChanged;              // function pointer and adding ours to the chain.   
+
+        keypad_commands.on_get_commands = grbl.on_get_commands;
+        grbl.on_get_commands = keypad_get_commands;
          
     }
     else{
@@ -40,6 +40,20 @@
 #define KEYPAD_I2CADDR 0x49
 #define STATUSDATA_SIZE 256
 
+// Controller side auto-repeat for held step jog and fine override keys, times in ms.
+#ifndef KEYPAD_REPEAT_DELAY
+#define KEYPAD_REPEAT_DELAY 400 // delay before the first repeat
+#endif
+#ifndef KEYPAD_REPEAT_RATE
+#define KEYPAD_REPEAT_RATE  200 // initial interval between repeats
+#endif
+#ifndef KEYPAD_REPEAT_MIN
+#define KEYPAD_REPEAT_MIN    40 // shortest interval between repeats
+#endif
+#ifndef KEYPAD_REPEAT_ACCEL
+#define KEYPAD_REPEAT_ACCEL  80 // next interval in percent of the current
+#endif
+
 #define JOG_XR   'R'
 #define JOG_XL   'L'
 #define JOG_YF   'F'
@@ -55,6 +69,21 @@
 #define JOG_XLZU 'u'
 #define JOG_XLZD 'x'
 
+// Key state bitmap jog: JOG_VECTOR followed by JOG_VECTOR_BYTES bytes carrying 7 bits each, least significant
+// byte first. Bit 2n is set while the positive and bit 2n + 1 while the negative direction key for axis n is pressed.
+// Bit 7 of the bitmap bytes is always clear and both direction bits of an axis are never set, so the bytes cannot
+// be mistaken for UNLOCK, RESET or CMD_JOG_CANCEL. A byte that is not received within JOG_VECTOR_TIMEOUT ms of
+// the previous one discards the partial bitmap.
+#define JOG_VECTOR 'J'
+#define JOG_VECTOR_BYTES ((N_AXIS * 2 + 6) / 7)
+#ifndef JOG_VECTOR_TIMEOUT
+#define JOG_VECTOR_TIMEOUT 50
+#endif
+
+// Sent by the pendant in reply to a keepalive read, or as a keycode in UART mode,
+// to request the last status frame again, e.g. on a CRC mismatch.
+#define KEYPAD_NAK 0x15
+
 #define MACROUP 0x18
 #define MACRODOWN 0x19
 #define MACROLEFT 0x1B
@@ -70,6 +99,82 @@
 #define LASER_MODE          1
 #define LATHE_MODE          2
 
+// Time in ms without a response from the pendant before it is considered disconnected
+// and an active jog is cancelled. Worst case jog stop latency is 1.25 times this value.
+#ifndef KEYPAD_LINK_TIMEOUT
+#define KEYPAD_LINK_TIMEOUT 250
+#endif
+
+// Time budget in us for status frame assembly in a single pass of the foreground loop. A frame is assembled
+// in stages (motion, position, machine settings, spindle, send) and at least one stage is run per pass.
+#ifndef KEYPAD_STATUS_BUDGET
+#define KEYPAD_STATUS_BUDGET 50
+#endif
+
+// Text messages to the pendant are queued and sent in KEYPAD_MSG_PAGE_SIZE characters pages.
+#ifndef KEYPAD_MSG_QUEUE
+#define KEYPAD_MSG_QUEUE 4 // must be a power of 2
+#endif
+#ifndef KEYPAD_MSG_LENGTH
+#define KEYPAD_MSG_LENGTH 64 // longer messages are truncated
+#endif
+#ifndef KEYPAD_MSG_PAGE_SIZE
+#define KEYPAD_MSG_PAGE_SIZE 16
+#endif
+#ifndef KEYPAD_MSG_PAGE_DELAY
+#define KEYPAD_MSG_PAGE_DELAY 20 // minimum time in ms between pages and to status and keycode traffic
+#endif
+
+// Interval in ms between actual spindle RPM samples for status frames while the spindle is on,
+// samples are taken outside of status frame assembly.
+#ifndef KEYPAD_SPINDLE_RATE
+#define KEYPAD_SPINDLE_RATE 200
+#endif
+
+// Macro slots starting with @ followed by a path are streamed from the local filesystem
+// through a KEYPAD_MACRO_WINDOW bytes read-ahead buffer.
+#ifndef KEYPAD_MACRO_FILES
+#if (defined(SDCARD_ENABLE) && SDCARD_ENABLE) || (defined(LITTLEFS_ENABLE) && LITTLEFS_ENABLE)
+#define KEYPAD_MACRO_FILES 1
+#else
+#define KEYPAD_MACRO_FILES 0
+#endif
+#endif
+#ifndef KEYPAD_MACRO_WINDOW
+#define KEYPAD_MACRO_WINDOW 32
+#endif
+#define KEYPAD_MACRO_FILE_PREFIX '@'
+
+// Set KEYPAD_IO_TASK to 1 to run pendant I/O from keypad_io_task() on a second core or in a separate task.
+// The protocol loop takes the status snapshots and passes them to the I/O task through a KEYPAD_SNAPSHOT_QUEUE
+// entries single-producer/single-consumer queue, the I/O task only packs and sends them and runs all I2C traffic,
+// including the keycode reads requested by the strobe interrupt. Homing requests from the I2C interrupt handlers
+// go to the protocol loop through a KEYPAD_ACTION_QUEUE entries queue. I2C mode only.
+#ifndef KEYPAD_IO_TASK
+#define KEYPAD_IO_TASK 0
+#endif
+#ifndef KEYPAD_ACTION_QUEUE
+#define KEYPAD_ACTION_QUEUE 8 // must be a power of 2
+#endif
+#ifndef KEYPAD_SNAPSHOT_QUEUE
+#define KEYPAD_SNAPSHOT_QUEUE 4 // must be a power of 2
+#endif
+
+// Set KEYPAD_PERF to 1 to add the $KPPERF command that benchmarks the plugin hot paths.
+#ifndef KEYPAD_PERF
+#define KEYPAD_PERF 0
+#endif
+#ifndef KEYPAD_PERF_ITERATIONS
+#define KEYPAD_PERF_ITERATIONS 1000
+#endif
+#ifndef KEYPAD_PERF_THRESHOLD
+#define KEYPAD_PERF_THRESHOLD 20 // percent above baseline reported as a regression
+#endif
+
+#if KEYPAD_PERF && KEYPAD_IO_TASK
+#error "KEYPAD_PERF is not supported when KEYPAD_IO_TASK is enabled!"
+#endif
+
 typedef union {
     uint8_t value;                 //!< Bitmask value
     struct {
@@ -109,8 +214,24 @@ float x_coordinate;
 float y_coordinate;
 float z_coordinate;
 float a_coordinate;
+uint32_t timestamp;  //controller time in ms when the frame was assembled
+float x_velocity;    //axis velocities in mm/min for extrapolating the DRO between frames
+float y_velocity;
+float z_velocity;
+float a_velocity;
+uint8_t sequence;    //incremented for every new frame, unchanged when a frame is resent
+uint16_t crc;        //CRC-16/CCITT-FALSE of all bytes before this field
 } Machine_status_packet;
 
+typedef struct Machine_message_packet {
+uint8_t address;  //0x02
+uint8_t type;     //0 = plain, 1 = info, 2 = warning
+uint8_t id;       //message sequence number
+uint8_t page;     //page number, starts at 0
+uint8_t pages;    //number of pages in the message
+char text[KEYPAD_MSG_PAGE_SIZE];  //not terminated if all characters are used
+} Machine_message_packet;
+
 typedef void (*keycode_callback_ptr)(const char c);
 typedef bool (*on_keypress_preview_ptr)(const char c, uint_fast16_t state);
 typedef void (*on_jogmode_changed_ptr)(jogmode_t jogmode);
@@ -136,5 +257,8 @@ extern keypad_t keypad;
 
 bool keypad_init (void);
 bool keypad_enqueue_keycode (char c);
+#if KEYPAD_IO_TASK
+void keypad_io_task (void);
+#endif
 
 #endif